@@ -19,16 +19,26 @@
    License along with cbird; if not, see
    <https://www.gnu.org/licenses/>.  */
 #include "colordescindex.h"
+#include "colorscan.h"
 #include "profile.h"
 
 #include <cfloat>
+#include <queue>
 
+/// Items scanned between updates of the distance bound in find()
+static constexpr int ColorScanBlock = 1024;
+
+/// Items scanned by one thread in findParallel(), about 800KB of ColorPlanes
+static constexpr int ColorParallelChunk = 2048;
 
 ColorDescIndex::ColorDescIndex() : Index() {
   _id = SearchParams::AlgoColor;
   _count = 0;
+  _numRemoved = 0;
   _mediaId = nullptr;
   _descriptors = nullptr;
+  _planes = nullptr;
+  std::fill_n(_bucket, NumBuckets + 1, 0);
 }
 
 ColorDescIndex::~ColorDescIndex() { unload(); }
@@ -91,10 +101,15 @@ void ColorDescIndex::removeRecords(QSqlDatabase& db, const QVector<int>& mediaId
 void ColorDescIndex::unload() {
   free(_mediaId);
   free(_descriptors);
+  free(_planes);
 
   _count = 0;
+  _numRemoved = 0;
   _mediaId = nullptr;
   _descriptors = nullptr;
+  _planes = nullptr;
+  std::fill_n(_bucket, NumBuckets + 1, 0);
+  _slots.clear();
 }
 
 bool ColorDescIndex::isLoaded() const { return _count > 0; }
@@ -103,7 +118,13 @@ int ColorDescIndex::count() const { return _count; }
 
 size_t ColorDescIndex::memoryUsage() const {
   size_t num = size_t(count());
-  return sizeof(ColorDescriptor) * num + sizeof(int) * num;
+  return (sizeof(ColorDescriptor) + sizeof(ColorPlanes) + sizeof(int)) * num +
+         _slots.memoryUsage();
+}
+
+size_t ColorDescIndex::wastedMemory() const {
+  return (sizeof(ColorDescriptor) + sizeof(ColorPlanes) + sizeof(*_mediaId)) *
+         size_t(_numRemoved);
 }
 
 void ColorDescIndex::load(QSqlDatabase& db, const QString& cachePath, const QString& dataPath) {
@@ -128,6 +149,7 @@ void ColorDescIndex::load(QSqlDatabase& db, const QString& cachePath, const QStr
 
   // allocate using malloc so we can use realloc() later
   _descriptors = strict_malloc(_descriptors, _count);
+  _planes = strict_malloc(_planes, _count);
   _mediaId = strict_malloc(_mediaId, _count);
 
   query.exec("select media_id,color_desc from color");
@@ -156,6 +178,7 @@ void ColorDescIndex::load(QSqlDatabase& db, const QString& cachePath, const QStr
       _descriptors[i].clear();
       qWarning("no color desc for id %d, correct by re-indexing", _mediaId[i]);
     }
+    colorUnpack(_descriptors[i], _planes[i]);
     i++;
 
     if (i % 20000 == 0)
@@ -164,6 +187,10 @@ void ColorDescIndex::load(QSqlDatabase& db, const QString& cachePath, const QStr
 
   } while (query.next());
 
+  _count = i;
+  partition();
+  _slots.build(_mediaId, size_t(_count));
+
   uint64_t end = nanoTime();
   qInfo("%d descriptors, %d empty, %dms", _count, empty, int((end - start) / 1000000));
 }
@@ -174,71 +201,161 @@ void ColorDescIndex::save(QSqlDatabase& db, const QString& cachePath) {
   (void)cachePath;
 }
 
-void ColorDescIndex::add(const MediaGroup& media) {
-  int end = _count;
-  _count += media.count();
+void ColorDescIndex::partition() {
+  // counting sort by number of colors
+  std::fill_n(_bucket, NumBuckets + 1, 0);
+  for (int i = 0; i < _count; i++) _bucket[bucketOf(_descriptors[i]) + 1]++;
+  for (int b = 0; b < NumBuckets; b++) _bucket[b + 1] += _bucket[b];
 
-  _mediaId = strict_realloc(_mediaId, _count);
-  _descriptors = strict_realloc(_descriptors, _count);
+  uint32_t* mediaId = strict_malloc(mediaId, _count);
+  ColorDescriptor* descriptors = strict_malloc(descriptors, _count);
+  ColorPlanes* planes = strict_malloc(planes, _count);
+
+  int next[NumBuckets];
+  std::copy_n(_bucket, NumBuckets, next);
+  for (int i = 0; i < _count; i++) {
+    const int j = next[bucketOf(_descriptors[i])]++;
+    mediaId[j] = _mediaId[i];
+    descriptors[j] = _descriptors[i];
+    planes[j] = _planes[i];
+  }
+
+  free(_mediaId);
+  free(_descriptors);
+  free(_planes);
+  _mediaId = mediaId;
+  _descriptors = descriptors;
+  _planes = planes;
+}
+
+void ColorDescIndex::moveItem(int from, int to) {
+  _mediaId[to] = _mediaId[from];
+  _descriptors[to] = _descriptors[from];
+  _planes[to] = _planes[from];
+  if (_mediaId[to]) _slots.set(_mediaId[to], uint32_t(to));
+}
 
-  for (int i = 0; i < media.count(); i++) {
-    const Media& m = media[i];
-    _mediaId[i + end] = uint32_t(m.id());
-    _descriptors[i + end] = m.colorDescriptor();
+void ColorDescIndex::insert(uint32_t mediaId, const ColorDescriptor& desc) {
+  // the first item of each following bucket moves to the end of that bucket,
+  // which opens a slot at the end of the item's bucket; the order within
+  // a bucket does not matter
+  const int bucket = bucketOf(desc);
+  int hole = _count++;
+  _bucket[NumBuckets] = _count;
+  for (int b = NumBuckets - 1; b > bucket; b--) {
+    const int first = _bucket[b];
+    if (first < hole) moveItem(first, hole);
+    hole = first;
+    _bucket[b]++;
   }
+
+  _mediaId[hole] = mediaId;
+  _descriptors[hole] = desc;
+  colorUnpack(desc, _planes[hole]);
+  if (mediaId) _slots.set(mediaId, uint32_t(hole));
+}
+
+void ColorDescIndex::add(const MediaGroup& media) {
+  const int size = _count + media.count();
+  _mediaId = strict_realloc(_mediaId, size);
+  _descriptors = strict_realloc(_descriptors, size);
+  _planes = strict_realloc(_planes, size);
+
+  for (const Media& m : media) insert(uint32_t(m.id()), m.colorDescriptor());
 }
 
 void ColorDescIndex::remove(const QVector<int>& toRemove) {
   if (!isLoaded()) return;
 
   // rather than realloc the index we can nullify the removed items
-  // todo: track the amount of wasted space and compact at some point
-  QSet<int> ids;
-  for (int id : toRemove) ids.insert(id);
+  // and compact once enough space is wasted, they stay in their bucket
+  for (int id : toRemove) {
+    const uint32_t i = _slots.slot(uint32_t(id));
+    if (i == IdSlotMap::NoSlot) continue;
+
+    _slots.remove(uint32_t(id));
+    _mediaId[i] = 0;
+    _descriptors[i].clear();
+    _planes[i].numColors = 0;
+    _numRemoved++;
+  }
 
-  for (int i = 0; i < _count; i++)
-    if (ids.contains(int(_mediaId[i]))) {
-      _mediaId[i] = 0;
-      _descriptors[i].clear();
-    }
+  if (_numRemoved > _count / 4) compactArrays();
+}
+
+void ColorDescIndex::compactArrays() {
+  if (_numRemoved == 0) return;
+
+  int i = 0, j = 0;
+  for (int b = 0; b < NumBuckets; b++) {
+    const int end = _bucket[b + 1];
+    _bucket[b] = j;
+    for (; i < end; i++)
+      if (_mediaId[i]) moveItem(i, j++);
+  }
+  _bucket[NumBuckets] = j;
+
+  _count = j;
+  _numRemoved = 0;
+  _mediaId = strict_realloc(_mediaId, _count);
+  _descriptors = strict_realloc(_descriptors, _count);
+  _planes = strict_realloc(_planes, _count);
+}
+
+void ColorDescIndex::compact(QSqlDatabase& db, const QString& cachePath) {
+  // no caching
+  (void)db;
+  (void)cachePath;
+  compactArrays();
 }
 
 bool ColorDescIndex::findIndexData(Media& m) const {
-  uint32_t id = uint32_t(m.id());
-  for (int i = 0; i < _count; i++)
-    if (_mediaId[i] == id) {
-      m.setColorDescriptor(_descriptors[i]);
-      return true;
-    }
-  return false;
+  const uint32_t i = _slots.slot(uint32_t(m.id()));
+  if (i == IdSlotMap::NoSlot) return false;
+
+  m.setColorDescriptor(_descriptors[i]);
+  return true;
 }
 
 Index* ColorDescIndex::slice(const QSet<uint32_t>& mediaIds) const {
   ColorDescIndex* chunk = new ColorDescIndex;
   chunk->_count = mediaIds.count();
   chunk->_descriptors = strict_malloc(chunk->_descriptors, chunk->_count);
+  chunk->_planes = strict_malloc(chunk->_planes, chunk->_count);
   chunk->_mediaId = strict_malloc(chunk->_mediaId, chunk->_count);
 
-  int j = 0;
-  for (int i = 0; i < _count; ++i)
-    if (mediaIds.contains(_mediaId[i])) {
-      Q_ASSERT(j < chunk->_count);
-      chunk->_descriptors[j] = _descriptors[i];
-      chunk->_mediaId[j] = _mediaId[i];
-      j++;
-    }
+  // items are copied in order, so the buckets are the same
+  int i = 0, j = 0;
+  for (int b = 0; b < NumBuckets; ++b) {
+    chunk->_bucket[b] = j;
+    for (; i < _bucket[b + 1]; ++i)
+      if (mediaIds.contains(_mediaId[i])) {
+        Q_ASSERT(j < chunk->_count);
+        chunk->_descriptors[j] = _descriptors[i];
+        chunk->_planes[j] = _planes[i];
+        chunk->_mediaId[j] = _mediaId[i];
+        j++;
+      }
+  }
+  chunk->_bucket[NumBuckets] = j;
   chunk->_count = j;
+  chunk->_slots.build(chunk->_mediaId, size_t(j));
 
   return chunk;
 }
 
-QVector<Index::Match> ColorDescIndex::find(const Media& m, const SearchParams& p) {
-  (void)p;
+/**
+ * @return number of matches find() keeps, Database::resolveMatches() only
+ *         uses maxMatches of them, and the needle itself if it is filtered out
+ */
+static size_t resultLimit(const SearchParams& p) {
+  return size_t(p.maxMatches) + (p.filterSelf ? 1 : 0);
+}
 
+bool ColorDescIndex::needleRange(const Media& m, ColorPlanes& needle, int& begin,
+                                 int& end) const {
   // todo: search tree for histograms
 
-  QVector<Index::Match> results;
-
   ColorDescriptor target = m.colorDescriptor();
   if (target.numColors <= 0) {
     Media tmp = m;
@@ -248,14 +365,67 @@ QVector<Index::Match> ColorDescIndex::find(const Media& m, const SearchParams& p
       qWarning() << "needle has no color descriptor" << m.path();
   }
 
-  for (int i = 0; i < _count; i++) {
-    float distance = ColorDescriptor::distance(target, _descriptors[i]);
+  const int numColors = bucketOf(target);
+  if (numColors <= 0) return false;
+
+  // other buckets are too far, ColorDescriptor::distance() is FLT_MAX
+  begin = _bucket[std::max(1, numColors - 2)];
+  end = _bucket[std::min(int(NumBuckets) - 1, numColors + 2) + 1];
+
+  colorUnpack(target, needle);
+  return true;
+}
 
-    if (distance < FLT_MAX) {
-      uint32_t id = _mediaId[i];
-      if (id != 0) results.append(Index::Match(id, int(distance)));
+QVector<Index::Match> ColorDescIndex::scanRange(const ColorPlanes& needle, int begin, int end,
+                                                size_t maxResults) const {
+  // once there are enough, anything not better than the worst is skipped by the kernel
+  std::priority_queue<Index::Match> best;  // worst on top
+  float bound = FLT_MAX;
+
+  float distances[ColorScanBlock];
+  for (int block = begin; block < end; block += ColorScanBlock) {
+    const int count = std::min(ColorScanBlock, end - block);
+    colorScan(needle, _planes + block, size_t(count), bound, distances);
+
+    for (int i = 0; i < count; i++) {
+      const float distance = distances[i];
+      const uint32_t id = _mediaId[block + i];
+      if (distance >= bound || id == 0) continue;
+
+      best.push(Index::Match(id, int(distance)));
+      if (best.size() > maxResults) best.pop();
+      if (best.size() == maxResults) bound = float(best.top().score);
     }
   }
 
+  QVector<Index::Match> results;
+  results.reserve(int(best.size()));
+  for (; !best.empty(); best.pop()) results.append(best.top());
   return results;
 }
+
+QVector<Index::Match> ColorDescIndex::find(const Media& m, const SearchParams& p) {
+  ColorPlanes needle;
+  int begin, end;
+  if (!needleRange(m, needle, begin, end)) return QVector<Index::Match>();
+
+  return scanRange(needle, begin, end, resultLimit(p));
+}
+
+QVector<Index::Match> ColorDescIndex::findParallel(const Media& m, const SearchParams& p) {
+  ColorPlanes needle;
+  int begin, end;
+  if (!needleRange(m, needle, begin, end)) return QVector<Index::Match>();
+
+  const size_t k = resultLimit(p);
+  QVector<Index::Match> matches = scanParallel(
+      begin, end, ColorParallelChunk,
+      [&](int from, int to, QVector<Index::Match>& out) { out = scanRange(needle, from, to, k); });
+
+  // merge the best of each chunk
+  if (size_t(matches.count()) > k) {
+    std::nth_element(matches.begin(), matches.begin() + int(k), matches.end());
+    matches.resize(int(k));
+  }
+  return matches;
+}
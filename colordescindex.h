@@ -19,13 +19,19 @@
    License along with cbird; if not, see
    <https://www.gnu.org/licenses/>.  */
 #pragma once
+#include "idslotmap.h"
 #include "index.h"
 
+struct ColorPlanes;
+
 /**
  * @class ColorDescIndex
  * @brief Index for ColorDescriptor
  *
  * Detects images with similar colors
+ *
+ * Items are partitioned by number of colors, since descriptors are only
+ * compared if the number of colors is within 2
  */
 class ColorDescIndex : public Index {
   Q_DISABLE_COPY_MOVE(ColorDescIndex)
@@ -40,6 +46,7 @@ class ColorDescIndex : public Index {
 
   bool isLoaded() const override;
   size_t memoryUsage() const override;
+  size_t wastedMemory() const override;
   int count() const override;
 
   void load(QSqlDatabase& db, const QString& cachePath, const QString& dataPath) override;
@@ -47,16 +54,39 @@ class ColorDescIndex : public Index {
 
   void add(const MediaGroup& media) override;
   void remove(const QVector<int>& id) override;
+  void compact(QSqlDatabase& db, const QString& cachePath) override;
 
   QVector<Index::Match> find(const Media& m, const SearchParams& p) override;
+  QVector<Index::Match> findParallel(const Media& m, const SearchParams& p) override;
   bool findIndexData(Media& m) const override;
 
   Index* slice(const QSet<uint32_t>& mediaIds) const override;
 
  private:
+  enum { NumBuckets = ColorDescriptor::NUM_DESC_COLORS + 1 };  // one per number of colors
+
+  static int bucketOf(const ColorDescriptor& desc) {
+    return std::min(int(desc.numColors), int(ColorDescriptor::NUM_DESC_COLORS));
+  }
+
   void unload();
+  void compactArrays();
+  void partition();
+  void insert(uint32_t mediaId, const ColorDescriptor& desc);
+  void moveItem(int from, int to);
+
+  /// @return false if the needle has no descriptor, else items [begin,end) may match
+  bool needleRange(const Media& m, ColorPlanes& needle, int& begin, int& end) const;
+
+  /// @return best maxResults matches of items [begin,end)
+  QVector<Index::Match> scanRange(const ColorPlanes& needle, int begin, int end,
+                                  size_t maxResults) const;
 
   int _count;
+  int _numRemoved;  // items with id 0
   uint32_t* _mediaId;
   ColorDescriptor* _descriptors;
+  ColorPlanes* _planes;  // unpacked _descriptors for colorScan()
+  int _bucket[NumBuckets + 1];  // items with n colors are [_bucket[n], _bucket[n+1])
+  IdSlotMap _slots;             // for findIndexData() and remove()
 };
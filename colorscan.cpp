@@ -0,0 +1,201 @@
+/* Fast color descriptor distance
+   Copyright (C) 2021 scrubbbbs
+   Contact: screubbbebs@gemeaile.com =~ s/e//g
+   Project: https://github.com/scrubbbbs/cbird
+
+   This file is part of cbird.
+
+   cbird is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   cbird is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with cbird; if not, see
+   <https://www.gnu.org/licenses/>.  */
+
+// kernels must give exactly the scalar result, so the release build
+// (-Ofast) may not contract to fma or reassociate anything in this file
+#if defined(__clang__)
+#  pragma clang fp contract(off) reassociate(off)
+#elif defined(__GNUC__)
+#  pragma GCC optimize("no-fast-math", "fp-contract=off")
+#endif
+
+#include "colorscan.h"
+
+#include "cvutil.h"
+
+#include <cfloat>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define COLOR_X86 (1)
+#endif
+
+static_assert(int(ColorPlanes::NumColors) == int(ColorDescriptor::NUM_DESC_COLORS),
+              "planes must hold every color");
+
+/// Value of unused colors, the distance to it is huge but finite
+static constexpr float ColorUnused = 1e18f;
+
+void colorUnpack(const ColorDescriptor& desc, ColorPlanes& planes) {
+  planes.numColors = desc.numColors;
+  for (int i = 0; i < ColorPlanes::NumColors; ++i)
+    if (i < desc.numColors)
+      desc.colors[i].get(planes.l[i], planes.u[i], planes.v[i]);
+    else
+      planes.l[i] = planes.u[i] = planes.v[i] = ColorUnused;
+}
+
+/// @return true if the descriptors can be compared
+static inline bool comparable(int numA, int numB) {
+  return numA > 0 && numB > 0 && abs(numA - numB) <= 2;
+}
+
+/**
+ * Sum of distances from each color in outer to the nearest color in inner
+ * @details outer is the descriptor with more colors, as in
+ *          ColorDescriptor::distance(). Every kernel sums in the same order,
+ *          and sqrt is monotonic, so taking the nearest by squared distance
+ *          gives the same result. The sum only grows, so it stops once it
+ *          reaches the bound
+ * @return score, or FLT_MAX if >= bound
+ */
+static float scoreScalar(const ColorPlanes& outer, const ColorPlanes& inner, float bound) {
+  float score = 1;
+  for (int i = 0; i < outer.numColors; ++i) {
+    float nearest = FLT_MAX;
+    for (int j = 0; j < inner.numColors; ++j) {
+      const float dl = outer.l[i] - inner.l[j];
+      const float du = outer.u[i] - inner.u[j];
+      const float dv = outer.v[i] - inner.v[j];
+      const float dist = dl * dl + du * du + dv * dv;
+      if (dist < nearest) nearest = dist;
+    }
+    score += sqrtf(nearest);
+    if (score >= bound) return FLT_MAX;
+  }
+  return score;
+}
+
+/// Distance with the needle (a) first, ties go to the needle as outer
+template <float (*Score)(const ColorPlanes&, const ColorPlanes&, float)>
+static inline float distance(const ColorPlanes& a, const ColorPlanes& b, float bound) {
+  if (!comparable(a.numColors, b.numColors)) return FLT_MAX;
+  return a.numColors < b.numColors ? Score(b, a, bound) : Score(a, b, bound);
+}
+
+float colorDistance(const ColorDescriptor& a, const ColorDescriptor& b) {
+  if (!comparable(a.numColors, b.numColors)) return FLT_MAX;
+
+  ColorPlanes pa, pb;
+  colorUnpack(a, pa);
+  colorUnpack(b, pb);
+  return distance<scoreScalar>(pa, pb, FLT_MAX);
+}
+
+static void scanScalar(const ColorPlanes& needle, const ColorPlanes* items, size_t count,
+                       float bound, float* distances) {
+  for (size_t i = 0; i < count; ++i)
+    distances[i] = distance<scoreScalar>(needle, items[i], bound);
+}
+
+#if COLOR_X86
+
+// unused colors of inner are compared too, which is faster than masking
+__attribute__((target("avx2"))) static float scoreAvx2(const ColorPlanes& outer,
+                                                      const ColorPlanes& inner, float bound) {
+  const int numVectors = (inner.numColors + 7) / 8;
+  float score = 1;
+  for (int i = 0; i < outer.numColors; ++i) {
+    const __m256 l = _mm256_set1_ps(outer.l[i]);
+    const __m256 u = _mm256_set1_ps(outer.u[i]);
+    const __m256 v = _mm256_set1_ps(outer.v[i]);
+
+    __m256 nearest = _mm256_set1_ps(FLT_MAX);
+    for (int j = 0; j < numVectors; ++j) {
+      const __m256 dl = _mm256_sub_ps(l, _mm256_loadu_ps(inner.l + j * 8));
+      const __m256 du = _mm256_sub_ps(u, _mm256_loadu_ps(inner.u + j * 8));
+      const __m256 dv = _mm256_sub_ps(v, _mm256_loadu_ps(inner.v + j * 8));
+      const __m256 dist = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dl, dl), _mm256_mul_ps(du, du)),
+                                        _mm256_mul_ps(dv, dv));
+      nearest = _mm256_min_ps(nearest, dist);
+    }
+
+    // horizontal min, order does not matter
+    __m128 m = _mm_min_ps(_mm256_castps256_ps128(nearest), _mm256_extractf128_ps(nearest, 1));
+    m = _mm_min_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_min_ss(m, _mm_shuffle_ps(m, m, 1));
+    score += sqrtf(_mm_cvtss_f32(m));
+    if (score >= bound) return FLT_MAX;
+  }
+  return score;
+}
+
+__attribute__((target("avx2"))) static void scanAvx2(const ColorPlanes& needle,
+                                                     const ColorPlanes* items, size_t count,
+                                                     float bound, float* distances) {
+  for (size_t i = 0; i < count; ++i)
+    distances[i] = distance<scoreAvx2>(needle, items[i], bound);
+}
+
+__attribute__((target("avx512f"))) static float scoreAvx512(const ColorPlanes& outer,
+                                                           const ColorPlanes& inner, float bound) {
+  const int numVectors = (inner.numColors + 15) / 16;
+  float score = 1;
+  for (int i = 0; i < outer.numColors; ++i) {
+    const __m512 l = _mm512_set1_ps(outer.l[i]);
+    const __m512 u = _mm512_set1_ps(outer.u[i]);
+    const __m512 v = _mm512_set1_ps(outer.v[i]);
+
+    __m512 nearest = _mm512_set1_ps(FLT_MAX);
+    for (int j = 0; j < numVectors; ++j) {
+      const __m512 dl = _mm512_sub_ps(l, _mm512_loadu_ps(inner.l + j * 16));
+      const __m512 du = _mm512_sub_ps(u, _mm512_loadu_ps(inner.u + j * 16));
+      const __m512 dv = _mm512_sub_ps(v, _mm512_loadu_ps(inner.v + j * 16));
+      const __m512 dist = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dl, dl), _mm512_mul_ps(du, du)),
+                                        _mm512_mul_ps(dv, dv));
+      nearest = _mm512_min_ps(nearest, dist);
+    }
+    score += sqrtf(_mm512_reduce_min_ps(nearest));
+    if (score >= bound) return FLT_MAX;
+  }
+  return score;
+}
+
+__attribute__((target("avx512f"))) static void scanAvx512(const ColorPlanes& needle,
+                                                          const ColorPlanes* items, size_t count,
+                                                          float bound, float* distances) {
+  for (size_t i = 0; i < count; ++i)
+    distances[i] = distance<scoreAvx512>(needle, items[i], bound);
+}
+
+#endif  // COLOR_X86
+
+const QVector<ColorScanKernel>& colorScanKernels() {
+  static const QVector<ColorScanKernel> kernels = [] {
+    QVector<ColorScanKernel> supported;
+#if COLOR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) supported.append({scanAvx512, "avx512"});
+    if (__builtin_cpu_supports("avx2")) supported.append({scanAvx2, "avx2"});
+#endif
+    supported.append({scanScalar, "scalar"});
+    return supported;
+  }();
+  return kernels;
+}
+
+void colorScan(const ColorPlanes& needle, const ColorPlanes* items, size_t count, float bound,
+               float* distances) {
+  static const auto scan = colorScanKernels().first().scan;
+  scan(needle, items, count, bound, distances);
+}
+
+const char* colorScanKernel() { return colorScanKernels().first().name; }
@@ -0,0 +1,65 @@
+/* Fast color descriptor distance
+   Copyright (C) 2021 scrubbbbs
+   Contact: screubbbebs@gemeaile.com =~ s/e//g
+   Project: https://github.com/scrubbbbs/cbird
+
+   This file is part of cbird.
+
+   cbird is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   cbird is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with cbird; if not, see
+   <https://www.gnu.org/licenses/>.  */
+#pragma once
+
+struct ColorDescriptor;
+
+/**
+ * @brief Colors of a ColorDescriptor unpacked to L,u,v planes (structure of arrays)
+ * @details Unused colors are set far from any color, so a kernel can
+ *          compare all of them and they are never the nearest
+ */
+struct ColorPlanes {
+  enum { NumColors = 32 };  // ColorDescriptor::NUM_DESC_COLORS
+  float l[NumColors];
+  float u[NumColors];
+  float v[NumColors];
+  int numColors;
+};
+
+/// Unpack colors for colorScan()
+void colorUnpack(const ColorDescriptor& desc, ColorPlanes& planes);
+
+/// Scalar distance, the same as ColorDescriptor::distance()
+float colorDistance(const ColorDescriptor& a, const ColorDescriptor& b);
+
+/**
+ * Distance from the needle to each item
+ * @details distances[i] is ColorDescriptor::distance(needle, item i),
+ *          the same value for every kernel, or FLT_MAX if it is >= bound,
+ *          which lets a kernel stop early. The widest kernel the cpu
+ *          supports is chosen at startup (AVX-512, AVX2, or scalar)
+ */
+void colorScan(const ColorPlanes& needle, const ColorPlanes* items, size_t count, float bound,
+               float* distances);
+
+/// @return name of the kernel used by colorScan()
+const char* colorScanKernel();
+
+/// One implementation of colorScan()
+struct ColorScanKernel {
+  void (*scan)(const ColorPlanes& needle, const ColorPlanes* items, size_t count, float bound,
+               float* distances);
+  const char* name;
+};
+
+/// @return every kernel the cpu supports, widest first; the first is used by colorScan()
+const QVector<ColorScanKernel>& colorScanKernels();
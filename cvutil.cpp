@@ -22,6 +22,7 @@
 
 #include "cimg_lib.h"
 #include "cimgops.h"
+#include "colorscan.h"
 #include "ioutil.h"
 #include "profile.h"
 
@@ -654,57 +655,8 @@ float ColorDescriptor::distance(const ColorDescriptor& a_, const ColorDescriptor
 
   return cv::EMD(ha, hb, CV_DIST_L2);
 #else
-
-  // swap a/b if b has more colors
-  const ColorDescriptor* a;
-  const ColorDescriptor* b;
-
-  if (a_.numColors < b_.numColors) {
-    a = &b_;
-    b = &a_;
-  } else {
-    a = &a_;
-    b = &b_;
-  }
-
-  const int numA = a->numColors;
-  const int numB = b->numColors;
-
-  float minDist[NUM_DESC_COLORS];
-  //    int minWeight[NUM_DESC_COLORS];
-
-  for (int i = 0; i < numA; i++) {
-    minDist[i] = FLT_MAX;
-
-    const DescriptorColor& c1 = a->colors[i];
-    //        const int w1 = c1.w;
-    float l1, u1, v1;
-    c1.get(l1, u1, v1);
-
-    for (int j = 0; j < numB; j++) {
-      const DescriptorColor& c2 = b->colors[j];
-      //            const int w2 = c2.w;
-
-      float l2, u2, v2;
-      c2.get(l2, u2, v2);
-
-      float dl = l1 - l2;
-      float du = u1 - u2;
-      float dv = v1 - v2;
-
-      float dist = sqrtf(dl * dl + du * du + dv * dv);
-
-      if (dist < minDist[i]) {
-        minDist[i] = dist;
-        //                minWeight[i] = abs(w1-w2);
-      }
-    }
-  }
-
-  float score = 1;
-  for (int i = 0; i < numA; i++) score += minDist[i];  //*minWeight[i];
-
-  return score;
+  // average distance to the nearest color, shared with colorScan()
+  return colorDistance(a_, b_);
 #endif
 }
 
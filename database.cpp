@@ -20,9 +20,11 @@
    <https://www.gnu.org/licenses/>.  */
 #include "database.h"
 
+#include "idslotmap.h"
 #include "profile.h"
 #include "qtutil.h"
 #include "templatematcher.h"
+#include "videohashstore.h"
 
 QAtomicInt& Database::connectionCount() {
   static auto* s = new QAtomicInt(0);
@@ -284,6 +286,8 @@ Database::Database(const QString& path_) {
 
   Q_ASSERT(dir.mkpath(cachePath()));
   Q_ASSERT(dir.mkpath(videoPath()));
+
+  _videoStore = new VideoHashStore(videoPath());
 }
 
 Database::~Database() {
@@ -293,6 +297,8 @@ Database::~Database() {
   saveIndices();
   qInfo("save Indices: done");
 
+  delete _videoStore;
+
   // close all db connections; hopefully there are no
   // threads running that want the db
   // fixme: why is this commented out?
@@ -359,6 +365,9 @@ void Database::add(MediaGroup& inMedia) {
     return;
   }
 
+  // another process may have written it, appending would overwrite that
+  _videoStore->reload();
+
   int mediaId = -1;
   {
     // using sql auto-increment and lastInsertId() is not going to work
@@ -436,10 +445,8 @@ void Database::add(MediaGroup& inMedia) {
       }
 #endif
 
-      if (m.type() == Media::TypeVideo && !m.videoIndex().isEmpty()) {
-        QString indexPath = QString("%1/%2.vdx").arg(videoPath()).arg(m.id());
-        m.videoIndex().save(indexPath);
-      }
+      if (m.type() == Media::TypeVideo && !m.videoIndex().isEmpty())
+        _videoStore->add(uint32_t(m.id()), m.videoIndex());
     }
 
     query.bindValue(":id", id);
@@ -453,6 +460,9 @@ void Database::add(MediaGroup& inMedia) {
     if (!query.execBatch()) SQL_FATAL(exec)
   }
 
+  // before Index::add(), which reads the store
+  _videoStore->commit();
+
   inMedia = media;
 
   now = nanoTime();
@@ -531,6 +541,7 @@ void Database::remove(const QVector<int>& ids) {
                 << "or lock file is stale";
     return;
   }
+  _videoStore->reload();
 
   QSqlQuery query(connect());
 
@@ -582,13 +593,10 @@ void Database::remove(const QVector<int>& ids) {
     then = now;
   }
 
-  // if it's a video, delete the hash file
+  // if it's a video, delete the hashes
   // todo: this could be in removeRecords()
-  for (int id : ids) {
-    QString hashFile = QString::asprintf("%s/%d.vdx", qPrintable(videoPath()), id);
-    if (QFileInfo::exists(hashFile))
-      if (!QFile(hashFile).remove()) qCritical("failure to delete file %s", qPrintable(hashFile));
-  }
+  for (int id : ids) _videoStore->remove(uint32_t(id));
+  _videoStore->commit();
 
   for (Index* i : _algos) i->remove(ids);
 }
@@ -601,6 +609,7 @@ void Database::vacuum() {
                 << "or lock file is stale";
     return;
   }
+  _videoStore->reload();
   qInfo("vacuum main db");
   const char* sql = "vacuum";
   QSqlQuery query(connect());
@@ -612,19 +621,30 @@ void Database::vacuum() {
     QSqlQuery query(db);
     if (!query.exec(sql)) SQL_FATAL(exec);
   }
-  // there was a bug that caused video index to be orphaned
-  const auto files = QDir(videoPath()).entryList({"*.vdx"});
-  for (const QString& f : files) {
-    bool ok = false;
-    int id = f.split(".").first().toInt(&ok);
-    if (!ok) continue;
-    if (mediaWithId(id).isValid()) continue;
-    qInfo() << "orphaned video index" << f;
-    if (!QFile(videoPath() + "/" + f).remove()) qWarning() << "failed to remove" << f;
-  }
+  // there was a bug that caused video index to be orphaned,
+  // this also moves any per-video files into the store
+  qInfo("vacuum video hashes");
+  _videoStore->compact([this](uint32_t id) { return mediaWithId(int(id)).isValid(); });
   // fixme: remove cache/tmp files
 }
 
+void Database::compact() {
+  for (Index* i : _algos) {
+    if (!i->hasCompact()) continue;  // loading it would be wasted
+
+    SearchParams params;
+    params.algo = i->id();
+    loadIndex(params);
+
+    QWriteLocker locker(&_rwLock);
+    qInfo("compact algo: %d, %.1f MB of %.1f MB unused", i->id(),
+          i->wastedMemory() / 1024.0 / 1024.0, i->memoryUsage() / 1024.0 / 1024.0);
+
+    QSqlDatabase db = connect(i->databaseId());
+    i->compact(db, cachePath());
+  }
+}
+
 QString Database::moveFile(const QString& srcPath, const QString& dstDir) {
   const QFileInfo srcInfo(srcPath);
   const QFileInfo dstInfo(dstDir);
@@ -1271,6 +1291,61 @@ void Database::filterMatches(const SearchParams& params, MediaGroupList& matches
     Media::expandGroupList(matches);
 }
 
+/**
+ * Matches of every needle from Index::findPairs()
+ * @details Rows of (score, haystack position) for each needle position,
+ *          so groups are built from the haystack without looking up ids
+ */
+struct JoinedMatches {
+  std::vector<uint32_t> offsets;               // first match of each needle, then the end
+  std::vector<std::pair<int, uint32_t>> rows;  // score and haystack position of the match
+
+  void build(const MediaGroup& haystack, const QVector<Index::Pair>& pairs) {
+    std::vector<uint32_t> ids;
+    ids.reserve(size_t(haystack.count()));
+    for (const Media& m : haystack) ids.push_back(uint32_t(m.id()));
+
+    IdSlotMap position;
+    position.build(ids.data(), ids.size());
+
+    // count the matches of each needle, then place them
+    offsets.assign(ids.size() + 1, 0);
+    for (const Index::Pair& pair : pairs) {
+      const uint32_t a = position.slot(pair.a), b = position.slot(pair.b);
+      if (a == IdSlotMap::NoSlot || b == IdSlotMap::NoSlot) continue;
+      offsets[a + 1]++;
+      if (a != b) offsets[b + 1]++;
+    }
+    for (size_t i = 1; i < offsets.size(); ++i) offsets[i] += offsets[i - 1];
+
+    std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+    rows.resize(offsets.back());
+    for (const Index::Pair& pair : pairs) {
+      const uint32_t a = position.slot(pair.a), b = position.slot(pair.b);
+      if (a == IdSlotMap::NoSlot || b == IdSlotMap::NoSlot) continue;
+      rows[next[a]++] = {pair.score, b};
+      if (a != b) rows[next[b]++] = {pair.score, a};
+    }
+  }
+
+  /// Same as Database::resolveMatches() with the needle's matches
+  MediaGroup resolve(const MediaGroup& haystack, int needle, const SearchParams& params) {
+    // rows of different needles do not overlap, so threads can sort them
+    auto begin = rows.begin() + offsets[size_t(needle)];
+    auto end = rows.begin() + offsets[size_t(needle) + 1];
+    std::sort(begin, end);
+
+    MediaGroup group;
+    for (auto it = begin; it != end && group.count() < params.maxMatches; ++it) {
+      if (params.filterSelf && int(it->second) == needle) continue;
+      Media media = haystack[int(it->second)];
+      media.setScore(it->first);
+      group.append(media);
+    }
+    return group;
+  }
+};
+
 MediaGroupList Database::similar(const SearchParams& params) {
   qint64 start = QDateTime::currentMSecsSinceEpoch();
 
@@ -1346,35 +1421,81 @@ MediaGroupList Database::similar(const SearchParams& params) {
   QSet<int> skip;
   QMutex mutex;
 
+  // if every item is both needle and haystack, the index may find all
+  // pairs at once instead of searching for each item
+  JoinedMatches joined;
+  bool useJoin = (!params.inSet || slice) && params.maxThresh <= 0 &&
+                 params.queryTypes == SearchParams::FlagImage;
+  if (useJoin) {
+    QVector<Index::Pair> pairs;
+    {
+      QReadLocker locker(&_rwLock);
+      useJoin = index->findPairs(params, pairs);
+    }
+    if (useJoin) {
+      joined.build(haystack, pairs);
+      qInfo("joined %lld pairs", pairs.count());
+    }
+  }
+
+  // search in blocks so the index can share work between needles,
+  // small enough that every thread gets some
+  const int numThreads = std::max(1, QThreadPool::globalInstance()->maxThreadCount());
+  const int blockSize = qBound(1, haystackSize / (numThreads * 8), 256);
+
+  QVector<int> blocks;  // haystack position of each block
+  for (int i = 0; i < haystackSize; i += blockSize) blocks.append(i);
+
   QFuture<void> f =
-      QtConcurrent::map(haystack, [&idMap, &results, &progress, &tm, progressInterval,
-                                   progressTotal, params, index, this](const Media& m) {
+      QtConcurrent::map(blocks, [&haystack, &idMap, &results, &progress, &tm, &joined, useJoin,
+                                 blockSize, progressInterval, progressTotal, params, index,
+                                 this](int blockStart) {
+        const MediaGroup block = haystack.mid(blockStart, blockSize);
+
+        QVector<MediaGroup> blockResults;
+        if (useJoin) {
+          for (int i = 0; i < block.count(); ++i)
+            blockResults.append(joined.resolve(haystack, blockStart + i, params));
+        } else {
+          QReadLocker locker(&_rwLock);
+          QVector<QVector<Index::Match>> batch;
+          if (params.maxThresh > 0)
+            for (const Media& m : block) batch.append(index->findNearest(m, params));
+          else
+            batch = index->findBatch(block, params);
+
+          for (int i = 0; i < block.count(); ++i)
+            blockResults.append(this->resolveMatches(index, block[i], params, idMap, batch[i]));
+        }
 
-        MediaGroup result = this->searchIndex(index, m, params, idMap);
+        for (int i = 0; i < block.count(); ++i) {
+          const Media& m = block[i];
+          MediaGroup& result = blockResults[i];
 
-        // give each work item a (lockless) way to write results
-        int resultIndex = progress.fetchAndAddRelaxed(1);
+          // give each work item a (lockless) way to write results
+          int resultIndex = progress.fetchAndAddRelaxed(1);
 
-        if (result.count() > 0) {
-          Media needle = m;
-          // set the dstIn frame number of the needle
-          // to the frame matched in the first search result
-          for (const Media& m : result)
-            if (m.matchRange().dstIn >= 0) {
-              needle.setMatchRange(MatchRange(-1, m.matchRange().srcIn, 1));
-              break;
-            }
+          if (result.count() > 0) {
+            Media needle = m;
+            // set the dstIn frame number of the needle
+            // to the frame matched in the first search result
+            for (const Media& m : result)
+              if (m.matchRange().dstIn >= 0) {
+                needle.setMatchRange(MatchRange(-1, m.matchRange().srcIn, 1));
+                break;
+              }
 
-          if (params.templateMatch) tm.match(needle, result, params);
+            if (params.templateMatch) tm.match(needle, result, params);
 
-          // needle must be prepended for filtering step
-          result.prepend(needle);
+            // needle must be prepended for filtering step
+            result.prepend(needle);
 
-          // we reserved the space so we can write without locks
-          results[resultIndex] = result;
+            // we reserved the space so we can write without locks
+            results[resultIndex] = result;
+          }
+          if ((resultIndex % progressInterval) == 0)
+            qInfo() << "<PL>" << resultIndex << progressTotal;
         }
-        if ((resultIndex % progressInterval) == 0)
-          qInfo() << "<PL>" << resultIndex << progressTotal;
       });
 
   f.waitForFinished();
@@ -1419,7 +1540,6 @@ MediaGroup Database::similarTo(const Media& needle, const SearchParams& params)
     }
   }
 
-  // todo: multicore search, for *huge* indexes it's an issue
   MediaGroup result = searchIndex(index, needle, params, idMap);
 
   delete slice;
@@ -1517,34 +1637,16 @@ MediaGroup Database::searchIndex(Index* index, const Media& needle, const Search
                                  const QHash<int, Media>& subset) {
   QReadLocker locker(&_rwLock);
 
-  QVector<Index::Match> matches = index->find(needle, params);
-
-  // increase threshold until is match is found or maxThresh is exceeded
-  if (params.maxThresh > 0) {
-    SearchParams tmp = params;
-    while (matches.count() <= params.minMatches) {
-      switch (params.algo) {
-        case SearchParams::AlgoDCT:
-        case SearchParams::AlgoDCTFeatures:
-        case SearchParams::AlgoVideo:
-          tmp.dctThresh++;
-          if (tmp.dctThresh > params.maxThresh) goto DONE;
-          break;
-        case SearchParams::AlgoCVFeatures:
-          tmp.cvThresh += 5;
-          if (tmp.cvThresh > params.maxThresh) goto DONE;
-          break;
-        case SearchParams::AlgoColor:
-          goto DONE;  // no thresholding
-        default:
-          qWarning() << "maxThresh: unsupported algorithm";
-          goto DONE;
-      }
-      matches = index->find(needle, tmp);
-    }
-  }
-DONE:
+  // one needle, so the index may use every thread
+  QVector<Index::Match> matches = params.maxThresh > 0 ? index->findNearest(needle, params)
+                                                       : index->findParallel(needle, params);
+
+  return resolveMatches(index, needle, params, subset, matches);
+}
 
+MediaGroup Database::resolveMatches(Index* index, const Media& needle, const SearchParams& params,
+                                    const QHash<int, Media>& subset,
+                                    QVector<Index::Match> matches) {
   // sort by score
   std::sort(matches.begin(), matches.end());
 
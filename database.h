@@ -23,6 +23,8 @@
 #include "index.h"
 #include "media.h"
 
+class VideoHashStore;
+
 /// Manage and query media in a directory
 class Database {
  public:
@@ -50,6 +52,9 @@ class Database {
   /// @return directory for video index files
   QString videoPath() const { return indexPath() + "/video"; }
 
+  /// @return frame hashes of all videos, stored in videoPath()
+  const VideoHashStore& videoStore() const { return *_videoStore; }
+
   /// @return path to index icon/thumbnail
   QString thumbPath() const { return path() + "/thumb.png"; };
 
@@ -191,6 +196,9 @@ class Database {
   /// Defragment sql databases, optimize indexes
   void vacuum();
 
+  /// Load indexes and free space taken by removed items, rewrite cache files
+  void compact();
+
   /// unit testing only: close all database connections (all threads),
   /// when called there must not be any live instances of Database
   static void disconnectAll();
@@ -223,6 +231,16 @@ private:
                          const SearchParams& params,
                          const QHash<int, Media>& subset);
 
+  /**
+   * @return Media for the index matches of needle, sorted and limited by params
+   * @param matches Result of Index::find(), findBatch() or findNearest() for needle
+   * @note caller must hold the read lock
+   */
+  MediaGroup resolveMatches(Index* index, const Media& needle,
+                            const SearchParams& params,
+                            const QHash<int, Media>& subset,
+                            QVector<Index::Match> matches);
+
   /// Create database (sql) tables for index id 0, the others use Index interface
   void createTables();
 
@@ -275,6 +293,9 @@ private:
   /// Registered algorithms
   QVector<Index*> _algos;
 
+  /// Video frame hashes, written by add()/remove()
+  VideoHashStore* _videoStore = nullptr;
+
   /// Sql column index for "media" table
   struct {
     int id, type, path, width, height, md5, phash_dct;
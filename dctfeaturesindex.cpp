@@ -81,17 +81,57 @@ void DctFeaturesIndex::removeRecords(QSqlDatabase& db, const QVector<int>& media
 void DctFeaturesIndex::init() {
   _id = SearchParams::AlgoDCTFeatures;
   _tree = nullptr;
+  _cacheFile = nullptr;
 }
 
 void DctFeaturesIndex::unload() {
   delete _tree;
+  delete _cacheFile;  // unmaps the tree clusters
   init();
 }
 
+bool DctFeaturesIndex::loadCache(const QString& path) {
+  QFile* file = new QFile(path);
+  if (!file->open(QFile::ReadOnly)) {
+    qWarning() << "cache: open failed:" << file->errorString();
+    delete file;
+    return false;
+  }
+
+  // private mapping lets remove() write to it (copy-on-write), untouched
+  // pages are shared with other processes using the same index
+  const qint64 size = file->size();
+  uchar* ptr = size > 0 ? file->map(0, size, QFileDevice::MapPrivateOption) : nullptr;
+
+  if (!ptr || !_tree->map(reinterpret_cast<char*>(ptr), size_t(size))) {
+    qWarning() << "cache: ignoring invalid or old version:" << path;
+    delete file;
+    // remove it or save() would not replace it until the database changes
+    QFile::remove(path);
+    return false;
+  }
+
+  _cacheFile = file;
+  return true;
+}
+
+void DctFeaturesIndex::detach() {
+  if (!_cacheFile) return;
+  _tree->detach();
+  delete _cacheFile;
+  _cacheFile = nullptr;
+}
+
 int DctFeaturesIndex::count() const { return _tree ? int(_tree->size()) : 0; }
 
 size_t DctFeaturesIndex::memoryUsage() const { return _tree ? _tree->stats().memory : 0; }
 
+size_t DctFeaturesIndex::wastedMemory() const {
+  if (!_tree) return 0;
+  return size_t(_tree->stats().numRemoved) *
+         (sizeof(HammingTree::hash_t) + sizeof(HammingTree::index_t));
+}
+
 bool DctFeaturesIndex::isLoaded() const { return _tree != nullptr; }
 
 void DctFeaturesIndex::load(QSqlDatabase& db, const QString& cachePath, const QString& dataPath) {
@@ -106,24 +146,30 @@ void DctFeaturesIndex::load(QSqlDatabase& db, const QString& cachePath, const QS
     unload();
     _tree = new HammingTree;
 
-    if (!stale) {
+    if (!stale && loadCache(path)) {
       qInfo("from cache");
-      _tree->read(qUtf8Printable(path));
     } else {
       QSqlQuery query(db);
       query.setForwardOnly(true);
 
-      // progress bar
-      if (!query.exec("select count(0) from kphash")) SQL_FATAL(exec);
+      // progress bar, and the size of the arrays so they are not grown
+      if (!query.exec("select count(0),sum(length(hashes)) from kphash")) SQL_FATAL(exec);
       if (!query.next()) SQL_FATAL(next);
 
       const uint64_t rowCount = query.value(0).toLongLong();
+      const size_t totalHashes = size_t(query.value(1).toLongLong()) / sizeof(uint64_t);
       uint64_t currentRow = 0;
       const QLocale locale;
       uint64_t numHashes = 0;  // total hashes seen
 
-      std::vector<HammingTree::Value> chunk;  // build tree in chunks to reduce temp memory
-      const int minChunkSize = 100000;
+      // note: build() partitions between these and the tree's cluster memory,
+      // so the peak during load is twice the size of the tree
+      std::vector<HammingTree::hash_t> treeHashes;
+      std::vector<HammingTree::index_t> treeIndices;
+      treeHashes.reserve(totalHashes);
+      treeIndices.reserve(totalHashes);
+      const int progressInterval = 100000;
+      uint64_t nextProgress = progressInterval;
 
       if (!query.exec("select media_id,hashes from kphash")) SQL_FATAL(exec);
 
@@ -141,20 +187,23 @@ void DctFeaturesIndex::load(QSqlDatabase& db, const QString& cachePath, const QS
         const uint64_t* ptr = reinterpret_cast<const uint64_t*>(hashes.constData());
         const int len = int(size_t(hashes.size()) / sizeof(uint64_t));
 
-        for (int j = 0; j < len; j++) chunk.push_back(HammingTree::Value(mediaId, ptr[j]));
+        treeHashes.insert(treeHashes.end(), ptr, ptr + len);
+        treeIndices.insert(treeIndices.end(), size_t(len), mediaId);
 
         numHashes += len;
 
-        if (chunk.size() >= minChunkSize) {  // todo: this size seems to have some small effect
-          _tree->insert(chunk);
-          chunk.clear();  // no reallocation
-
+        if (numHashes >= nextProgress) {
+          nextProgress = numHashes + progressInterval;
           qInfo("sql query:<PL> %d%% %s hashes", int(currentRow * 100 / rowCount),
                 qPrintable(locale.toString(numHashes)));
         }
       }
-      _tree->insert(chunk);
-      chunk.clear();
+      _tree->build(treeHashes, treeIndices);
+
+      // release the scratch before writing the cache
+      std::vector<HammingTree::hash_t>().swap(treeHashes);
+      std::vector<HammingTree::index_t>().swap(treeIndices);
+
       save(db, cachePath);
     }
 
@@ -173,6 +222,13 @@ void DctFeaturesIndex::save(QSqlDatabase& db, const QString& cachePath) {
 
   if (!DBHelper::isCacheFileStale(db, path)) return;
 
+  writeCache(path);
+}
+
+void DctFeaturesIndex::writeCache(const QString& path) {
+  // we cannot replace the file while it is mapped (win32)
+  detach();
+
   qInfo() << "save tree";
   writeFileAtomically(path, [this](QFile& f) { _tree->write(f); });
 }
@@ -196,6 +252,14 @@ void DctFeaturesIndex::remove(const QVector<int>& ids) {
   _tree->remove(indices);
 }
 
+void DctFeaturesIndex::compact(QSqlDatabase& db, const QString& cachePath) {
+  (void)db;
+  if (!isLoaded()) return;
+
+  _tree->compact();
+  writeCache(cacheFile(cachePath));
+}
+
 Index* DctFeaturesIndex::slice(const QSet<uint32_t>& mediaIds) const {
   DctFeaturesIndex* chunk = new DctFeaturesIndex;
 
@@ -217,7 +281,12 @@ Index* DctFeaturesIndex::slice(const QSet<uint32_t>& mediaIds) const {
 }
 
 QVector<Index::Match> DctFeaturesIndex::find(const Media& needle, const SearchParams& params) {
-  KeyPointHashList hashes = needle.keyPointHashes();
+  return findBatch({needle}, params).first();
+}
+
+QVector<QVector<Index::Match>> DctFeaturesIndex::findBatch(const MediaGroup& needles,
+                                                           const SearchParams& params) {
+  QVector<QVector<Index::Match>> results;
 
   //
   // for each needle hash
@@ -226,88 +295,98 @@ QVector<Index::Match> DctFeaturesIndex::find(const Media& needle, const SearchPa
   //
   uint64_t now, then = nanoTime();
 
-  if (hashes.size() <= 0) {
-    // if we don't have hashes for the needle,
-    // we can get them from tree
-    if (needle.id() > 0) _tree->findIndex(needle.id(), hashes);
+  // hashes of all needles are searched in one traversal
+  KeyPointHashList nHash;
+  QVector<size_t> offsets;  // nHash[offsets[i]...offsets[i+1]] belongs to needles[i]
+  for (const Media& needle : needles) {
+    KeyPointHashList hashes = needle.keyPointHashes();
 
     if (hashes.size() <= 0) {
-      qWarning() << "no hashes for needle id" << needle.id() << needle.path();
-      return QVector<Index::Match>();
-    }
-  }
+      // if we don't have hashes for the needle,
+      // we can get them from tree
+      if (needle.id() > 0) _tree->findIndex(needle.id(), hashes);
 
-  const int numNeedleHashes = hashes.size();
-  uint64_t nHash[numNeedleHashes];
+      if (hashes.size() <= 0)
+        qWarning() << "no hashes for needle id" << needle.id() << needle.path();
+    }
 
-  for (int j = 0; j < numNeedleHashes; j++) nHash[j] = hashes[j];
+    offsets.append(nHash.size());
+    nHash.insert(nHash.end(), hashes.begin(), hashes.end());
+  }
+  offsets.append(nHash.size());
 
   // todo: investigate if it may be possible to prune the search
   // - if a hash has no matches, nearby hashes probably also have no matches
-  std::vector<HammingTree::Match> cand[numNeedleHashes];
-  for (int j = 0; j < numNeedleHashes; j++) _tree->search(nHash[j], params.dctThresh, cand[j]);
-
-  QMap<uint32_t, uint32_t> matches;  // map
-  QMap<uint32_t, int> scores;
-  uint32_t maxMatches = 0;
-
-  for (int j = 0; j < numNeedleHashes; j++) {
-    // take the first 10, which gives us the 10 best matches
-    int len = std::min(10, (int)cand[j].size());
-    for (int k = 0; k < len; k++) {
-      const HammingTree::Match& match = cand[j][k];
-      int index = match.value.index;
-
-      // zero index means deleted, negative must be bogus
-      if (index <= 0) continue;
-
-      uint64_t hash = match.value.hash;
-      Q_ASSERT(hamm64(hash, nHash[j]) < params.dctThresh);
-
-      int mediaId = index;
-
-      if (matches.contains(mediaId)) {
-        matches[mediaId]++;
-        scores[mediaId] += match.distance;
-      } else {
-        matches[mediaId] = 1;
-        scores[mediaId] = match.distance;
-      }
+  std::vector<std::vector<HammingTree::Match>> cand;
+  _tree->search(nHash, params.dctThresh, cand, params.treeProbes);
+
+  for (int i = 0; i < needles.count(); ++i) {
+    const Media& needle = needles[i];
+
+    QMap<uint32_t, uint32_t> matches;  // map
+    QMap<uint32_t, int> scores;
+    uint32_t maxMatches = 0;
+
+    for (size_t j = offsets[i]; j < offsets[i + 1]; j++) {
+      // take the first 10, which gives us the 10 best matches
+      int len = std::min(10, (int)cand[j].size());
+      for (int k = 0; k < len; k++) {
+        const HammingTree::Match& match = cand[j][k];
+        int index = match.value.index;
+
+        // zero index means deleted, negative must be bogus
+        if (index <= 0) continue;
+
+        uint64_t hash = match.value.hash;
+        Q_ASSERT(hamm64(hash, nHash[j]) < params.dctThresh);
+
+        int mediaId = index;
 
-      if (needle.id() != mediaId) maxMatches = std::max(matches[mediaId], maxMatches);
+        if (matches.contains(mediaId)) {
+          matches[mediaId]++;
+          scores[mediaId] += match.distance;
+        } else {
+          matches[mediaId] = 1;
+          scores[mediaId] = match.distance;
+        }
+
+        if (needle.id() != mediaId) maxMatches = std::max(matches[mediaId], maxMatches);
+      }
     }
+
+    QVector<Index::Match> result;
+
+    for (uint32_t mediaId : matches.keys())
+      if (matches[mediaId] > 0) {
+        Index::Match match;
+        match.mediaId = mediaId;
+        match.score = 0;
+
+        float avgScore = (float)scores[mediaId] / matches[mediaId];
+
+        // qDebug("score=%.2f matches=%d maxMatches=%d", avgScore, matches[mediaId], maxMatches);
+        if (mediaId == uint32_t(needle.id()))
+          match.score = -1;
+        else if (maxMatches == 1) {
+          // only one match, use the avg score
+          match.score = 10 * avgScore;
+        } else {
+          // more matches gets lower score
+          // quality of each match is controlled by params.dctThresh
+          match.score = maxMatches - matches[mediaId];
+        }
+
+        result.append(match);
+      }
+
+    results.append(result);
   }
 
   now = nanoTime();
   if (params.verbose)
-    qInfo("%d features, %lld results, %.1f ms rate=%.1f Mhash/sec", numNeedleHashes,
-          matches.count(), (now - then) / 1000000.0,
-          (_tree->size() * numNeedleHashes) / ((now - then) / 1000.0));
-
-  QVector<Index::Match> results;
-
-  for (uint32_t mediaId : matches.keys())
-    if (matches[mediaId] > 0) {
-      Index::Match match;
-      match.mediaId = mediaId;
-      match.score = 0;
-
-      float avgScore = (float)scores[mediaId] / matches[mediaId];
-
-      // qDebug("score=%.2f matches=%d maxMatches=%d", avgScore, matches[mediaId], maxMatches);
-      if (mediaId == uint32_t(needle.id()))
-        match.score = -1;
-      else if (maxMatches == 1) {
-        // only one match, use the avg score
-        match.score = 10 * avgScore;
-      } else {
-        // more matches gets lower score
-        // quality of each match is controlled by params.dctThresh
-        match.score = maxMatches - matches[mediaId];
-      }
-
-      results.append(match);
-    }
+    qInfo("%d needles, %d features, %.1f ms rate=%.1f Mhash/sec", int(needles.count()),
+          int(nHash.size()), (now - then) / 1000000.0,
+          (_tree->size() * nHash.size()) / ((now - then) / 1000.0));
 
   return results;
 }
@@ -45,19 +45,28 @@ class DctFeaturesIndex : public Index {
   int count() const override;
   bool isLoaded() const override;
   size_t memoryUsage() const override;
+  size_t wastedMemory() const override;
 
   void load(QSqlDatabase& db, const QString& cachePath, const QString& dataPath) override;
   void save(QSqlDatabase& db, const QString& cachePath) override;
 
   void add(const MediaGroup& media) override;
   void remove(const QVector<int>& id) override;
+  void compact(QSqlDatabase& db, const QString& cachePath) override;
+  bool hasCompact() const override { return true; }
 
   QVector<Index::Match> find(const Media& m, const SearchParams& p) override;
+  QVector<QVector<Index::Match>> findBatch(const MediaGroup& needles,
+                                           const SearchParams& p) override;
 
   Index* slice(const QSet<uint32_t>& mediaIds) const override;
 
  private:
   void init();
   void unload();
+  bool loadCache(const QString& path);
+  void writeCache(const QString& path);
+  void detach();
   HammingTree* _tree;
+  QFile* _cacheFile;  // if non-null, _tree clusters are mapped from it
 };
@@ -20,8 +20,35 @@
    <https://www.gnu.org/licenses/>.  */
 #include "dcthashindex.h"
 
+#include "hamm.h"
+#include "ioutil.h"
 #include "profile.h"
+#include "qtutil.h"
 #include "tree/dcttree.h"
+#include "tree/multiindexhash.h"
+
+static QString cacheFile(const QString& cachePath) { return cachePath + qq("/dcthash.cache"); }
+
+/**
+ * Cache file header
+ * @details followed by hashes[numHashes], mediaIds[numHashes], then
+ *          tree data at treeOffset. Arrays are in native byte order
+ *          so they can be mapped into memory as-is
+ */
+struct DctHashCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t treeFormat;  // DctTree::Format
+  uint64_t numHashes;
+  uint64_t treeOffset;
+  uint64_t treeLength;
+};
+
+static constexpr char DctHashCacheMagic[8] = {'c', 'b', 'd', 'c', 't', 'h', 's', 'h'};
+static constexpr uint32_t DctHashCacheVersion = 1;
+
+/// Hashes scanned by one thread in findParallel(), 512KB
+static constexpr int DctHashParallelChunk = 65536;
 
 DctHashIndex::DctHashIndex() {
   _id = SearchParams::AlgoDCT;
@@ -32,8 +59,11 @@ void DctHashIndex::init() {
   _hashes = nullptr;
   _mediaId = nullptr;
   _numHashes = 0;
+  _numRemoved = 0;
   _isLoaded = false;
   _tree = nullptr;
+  _mih = nullptr;
+  _cacheFile = nullptr;
 }
 
 DctHashIndex::~DctHashIndex() { unload(); }
@@ -43,18 +73,102 @@ void DctHashIndex::unload() {
   // usage could be huge, we could use the savings,
   // plus realloc() is super cheap in case QVector
   // doesn't use it (which would be dumb)
-  free(_hashes);
-  free(_mediaId);
+  if (_cacheFile)
+    delete _cacheFile;  // unmaps the arrays
+  else {
+    free(_hashes);
+    free(_mediaId);
+  }
   delete _tree;
+  delete _mih;
   init();
 }
 
+void DctHashIndex::detach() {
+  if (!_cacheFile) return;
+
+  // arrays are mapped from the cache file; copy them so they
+  // can be resized, or the cache file replaced
+  uint64_t* hashes = strict_malloc(hashes, _numHashes);
+  uint32_t* mediaId = strict_malloc(mediaId, _numHashes);
+  memcpy(hashes, _hashes, sizeof(*hashes) * size_t(_numHashes));
+  memcpy(mediaId, _mediaId, sizeof(*mediaId) * size_t(_numHashes));
+  if (_tree) _tree->detach();
+
+  delete _cacheFile;
+  _cacheFile = nullptr;
+  _hashes = hashes;
+  _mediaId = mediaId;
+}
+
+bool DctHashIndex::loadCache(const QString& path) {
+  QFile* file = new QFile(path);
+  if (!file->open(QFile::ReadOnly)) {
+    qWarning() << "cache: open failed:" << file->errorString();
+    delete file;
+    return false;
+  }
+
+  DctHashCacheHeader header;
+  const qint64 size = file->size();
+  uchar* ptr = nullptr;
+
+  if (size >= qint64(sizeof(header)))
+    // private mapping lets remove() write to it (copy-on-write)
+    ptr = file->map(0, size, QFileDevice::MapPrivateOption);
+
+  if (ptr) memcpy(&header, ptr, sizeof(header));
+
+  const uint64_t arraysEnd =
+      sizeof(header) + (sizeof(*_hashes) + sizeof(*_mediaId)) * (ptr ? header.numHashes : 0);
+
+  if (!ptr || memcmp(header.magic, DctHashCacheMagic, sizeof(header.magic)) != 0 ||
+      header.version != DctHashCacheVersion || header.treeFormat != DctTree::Format ||
+      header.numHashes > INT_MAX || header.treeOffset < arraysEnd ||
+      header.treeOffset + header.treeLength != uint64_t(size)) {
+    qWarning() << "cache: ignoring invalid or old version:" << path;
+    delete file;
+    // remove it, or it is not stale and save() would never replace it
+    QFile::remove(path);
+    return false;
+  }
+
+  _cacheFile = file;
+  _numHashes = int(header.numHashes);
+  _hashes = reinterpret_cast<uint64_t*>(ptr + sizeof(header));
+  _mediaId =
+      reinterpret_cast<uint32_t*>(ptr + sizeof(header) + sizeof(*_hashes) * header.numHashes);
+
+  if (_numHashes > 0) {
+    _tree = new DctTree;
+    // tree is used in place, the mapping is private so remove() can modify it
+    if (!_tree->map(reinterpret_cast<char*>(ptr + header.treeOffset), header.treeLength)) {
+      qInfo("cache: tree not stored, rebuilding");
+      buildTree();
+      // some tree types are never stored (no data), otherwise the stored one was invalid
+      if (header.treeLength > 0) writeCache(path);
+    }
+  }
+
+  return true;
+}
+
 size_t DctHashIndex::memoryUsage() const {
-  // todo: tree->memoryUsage
-  return (sizeof(*_hashes) + sizeof(*_mediaId)) * size_t(_numHashes);
+  return (sizeof(*_hashes) + sizeof(*_mediaId)) * size_t(_numHashes) + treeMemoryUsage() +
+         mihMemoryUsage();
+}
+
+size_t DctHashIndex::treeMemoryUsage() const { return _tree ? _tree->memoryUsage() : 0; }
+
+size_t DctHashIndex::mihMemoryUsage() const { return _mih ? _mih->memoryUsage() : 0; }
+
+size_t DctHashIndex::wastedMemory() const {
+  return (sizeof(*_hashes) + sizeof(*_mediaId)) * size_t(_numRemoved);
 }
 
 void DctHashIndex::buildTree() {
+  delete _mih;
+  _mih = nullptr;
   delete _tree;
   _tree = nullptr;
   if (_numHashes > 0) {
@@ -64,8 +178,6 @@ void DctHashIndex::buildTree() {
 }
 
 void DctHashIndex::load(QSqlDatabase& db, const QString& cachePath, const QString& dataPath) {
-  // hashes are always loaded from database, no caching
-  (void)cachePath;
   (void)dataPath;
 
   if (!isLoaded()) {
@@ -75,7 +187,10 @@ void DctHashIndex::load(QSqlDatabase& db, const QString& cachePath, const QStrin
 
     uint64_t start = nanoTime();
 
-    {
+    const QString path = cacheFile(cachePath);
+    if (!DBHelper::isCacheFileStale(db, path) && loadCache(path)) {
+      qInfo("from cache");
+    } else {
       QSqlQuery query(db);
       query.setForwardOnly(true);
 
@@ -110,9 +225,10 @@ void DctHashIndex::load(QSqlDatabase& db, const QString& cachePath, const QStrin
       }
 
       _numHashes = i;
-    }
 
-    buildTree();
+      buildTree();
+      save(db, cachePath);
+    }
 
     uint64_t end = nanoTime();
     qInfo("%d hashes, %dms", _numHashes, int((end - start) / 1000000));
@@ -120,12 +236,59 @@ void DctHashIndex::load(QSqlDatabase& db, const QString& cachePath, const QStrin
 }
 
 void DctHashIndex::save(QSqlDatabase& db, const QString& cachePath) {
-  (void)db;
-  (void)cachePath;
-  // todo: _tree->save()
+  if (!isLoaded()) return;
+
+  const QString path = cacheFile(cachePath);
+
+  if (!DBHelper::isCacheFileStale(db, path)) return;
+
+  writeCache(path);
+}
+
+void DctHashIndex::writeCache(const QString& path) {
+  // we cannot replace the file while it is mapped (win32)
+  detach();
+
+  // removed items are not saved, the tree keeps its own
+  compactArrays();
+
+  qInfo() << "save cache";
+  writeFileAtomically(path, [this](QFile& f) {
+    DctHashCacheHeader header;
+    memcpy(header.magic, DctHashCacheMagic, sizeof(header.magic));
+    header.version = DctHashCacheVersion;
+    header.treeFormat = DctTree::Format;
+    header.numHashes = uint64_t(_numHashes);
+
+    // tree is aligned for the mapping
+    const uint64_t arraysEnd =
+        sizeof(header) + (sizeof(*_hashes) + sizeof(*_mediaId)) * header.numHashes;
+    header.treeOffset = (arraysEnd + 7) & ~uint64_t(7);
+    header.treeLength = 0;
+
+    const qint64 hashesLen = qint64(sizeof(*_hashes)) * _numHashes;
+    const qint64 idsLen = qint64(sizeof(*_mediaId)) * _numHashes;
+    const QByteArray padding(int(header.treeOffset - arraysEnd), 0);
+
+    if (f.write(reinterpret_cast<const char*>(&header), sizeof(header)) != sizeof(header) ||
+        f.write(reinterpret_cast<const char*>(_hashes), hashesLen) != hashesLen ||
+        f.write(reinterpret_cast<const char*>(_mediaId), idsLen) != idsLen ||
+        f.write(padding) != padding.length())
+      throw f.errorString();
+
+    if (_tree) _tree->write(f);
+
+    // now we know the tree length, update the header
+    header.treeLength = uint64_t(f.pos()) - header.treeOffset;
+    if (!f.seek(0) ||
+        f.write(reinterpret_cast<const char*>(&header), sizeof(header)) != sizeof(header))
+      throw f.errorString();
+  });
 }
 
 void DctHashIndex::add(const MediaGroup& media) {
+  detach();
+
   int end = _numHashes;
   _numHashes += media.count();
 
@@ -138,54 +301,279 @@ void DctHashIndex::add(const MediaGroup& media) {
     _mediaId[i + end] = uint32_t(m.id());
   }
 
-  // todo: _tree->insert(media);
-  buildTree();
+  if (!_tree) _tree = new DctTree;
+  _tree->insert(_hashes + end, _mediaId + end, media.count());
+  if (_mih) _mih->insert(_hashes + end, _mediaId + end, size_t(media.count()));
 }
 
 void DctHashIndex::remove(const QVector<int>& removed) {
   if (!isLoaded()) return;
 
   // rather than realloc the index, nullify the removed items
-  // todo: track the amount of wasted space and compact at some point
+  // and compact once enough space is wasted
   QSet<int> ids;
   for (int id : removed) ids.insert(id);
 
+  // the tree removes all of them in one pass
+  std::vector<uint64_t> treeHashes;
+  std::vector<uint32_t> treeIds;
+
   for (int i = 0; i < _numHashes; i++)
-    if (ids.contains(int(_mediaId[i]))) {
+    if (_mediaId[i] && ids.contains(int(_mediaId[i]))) {
+      treeHashes.push_back(_hashes[i]);
+      treeIds.push_back(_mediaId[i]);
+      if (_mih) _mih->remove(_hashes[i], _mediaId[i]);
       _mediaId[i] = 0;
       _hashes[i] = 0;
+      _numRemoved++;
+    }
+
+  if (_tree && !treeIds.empty())
+    _tree->remove(treeHashes.data(), treeIds.data(), int(treeIds.size()));
+
+  if (_numRemoved > _numHashes / 4) compactArrays();
+}
+
+void DctHashIndex::compactArrays() {
+  if (_numRemoved == 0) return;
+
+  // tree and mih have their own copy and are not affected
+  detach();
+
+  int j = 0;
+  for (int i = 0; i < _numHashes; ++i)
+    if (_mediaId[i]) {
+      _hashes[j] = _hashes[i];
+      _mediaId[j] = _mediaId[i];
+      j++;
     }
 
-  // todo: _tree->remove()
-  buildTree();
+  _numHashes = j;
+  _numRemoved = 0;
+  _hashes = strict_realloc(_hashes, _numHashes);
+  _mediaId = strict_realloc(_mediaId, _numHashes);
+}
+
+void DctHashIndex::compact(QSqlDatabase& db, const QString& cachePath) {
+  (void)db;
+  if (!isLoaded()) return;
+
+  compactArrays();
+  if (_tree) _tree->compact();
+  if (_mih) _mih->compact();
+
+  writeCache(cacheFile(cachePath));
+}
+
+/**
+ * @return true if brute-force scan is expected to beat the tree
+ * @details The tree visits a fraction of the index that grows quickly with
+ * threshold, and each visit costs much more than scanning a hash
+ */
+static bool scanIsFaster(int numHashes, int threshold) {
+  // percent of nodes visited by vptree (1M uniform random hashes) by threshold
+  static const float visited[] = {0.0f,   0.054f,  0.210f,  0.563f,  1.256f,  2.547f,
+                                  4.718f, 8.187f,  13.309f, 20.352f, 29.328f, 39.795f,
+                                  50.983f, 62.038f, 72.286f, 80.928f, 87.660f};
+  static const int maxThresh = sizeof(visited) / sizeof(visited[0]) - 1;
+
+  // relative cost of visiting a tree node vs scanning one hash
+  static const float treeCost = 16.0f;
+
+  if (numHashes < 4096) return true;  // scan fits in cache, tree has overhead
+  if (threshold > maxThresh) return true;
+
+  // the visited fraction shrinks slowly as the index grows
+  const float scale = powf(numHashes / 1000000.0f, -0.25f);
+  const float fraction = std::min(1.0f, visited[threshold] * scale / 100.0f);
+
+  return fraction * treeCost > 1.0f;
+}
+
+/// @return DctEngineXXX used for the search
+static int searchEngine(int numHashes, const SearchParams& p) {
+  if (p.dctEngine != SearchParams::DctEngineAuto) return p.dctEngine;
+  return scanIsFaster(numHashes, p.dctThresh) ? SearchParams::DctEngineScan
+                                              : SearchParams::DctEngineTree;
 }
 
 QVector<Index::Match> DctHashIndex::find(const Media& m, const SearchParams& p) {
-  QVector<Index::Match> results;
+  return findBatch({m}, p).first();
+}
+
+QVector<Index::Match> DctHashIndex::findNearest(const Media& m, const SearchParams& p) {
+  // same result as the default (find() with increasing threshold),
+  // the lowest threshold with more than minMatches
+  const int k = p.minMatches + 1;
+  const int minThresh = p.dctThresh;
+  const int maxThresh = std::max(p.dctThresh, p.maxThresh);
+
+  QVector<Index::Match> matches;
+  if (p.dctEngine == SearchParams::DctEngineTree ||
+      (p.dctEngine == SearchParams::DctEngineAuto && !scanIsFaster(_numHashes, maxThresh))) {
+    const uint64_t target = hashForMedia(m);
+    if (!target) {
+      qWarning() << "no hash for needle:" << m.path();
+      return matches;
+    }
+    if (!_tree) {
+      qWarning() << "empty/null tree";
+      return matches;
+    }
+    // the radius shrinks as matches are found
+    for (const Index::Match& match : _tree->searchNearest(target, k, minThresh, maxThresh))
+      if (match.mediaId != 0) matches.append(match);
+  } else {
+    SearchParams tmp = p;
+    tmp.dctThresh = maxThresh;
+    matches = find(m, tmp);
+  }
+
+  if (matches.count() <= k) return matches;
+
+  // trim to the threshold the k-th nearest match needs
+  std::sort(matches.begin(), matches.end());
+  const int radius = std::max(minThresh, matches[k - 1].score + 1);
+  while (matches.count() > k && matches.last().score >= radius) matches.removeLast();
+  return matches;
+}
+
+QVector<Index::Match> DctHashIndex::findParallel(const Media& m, const SearchParams& p) {
+  // only the scan is split, the other engines are fast enough for one needle
+  if (searchEngine(_numHashes, p) != SearchParams::DctEngineScan) return find(m, p);
 
-  uint64_t target = hashForMedia(m);
+  const uint64_t target = hashForMedia(m);
   if (!target) {
     qWarning() << "no hash for needle:" << m.path();
-    return results;
+    return QVector<Index::Match>();
   }
 
-  if (!_tree) {
-    qWarning() << "empty/null tree";
-    return results;
+  if (p.verbose)
+    qInfo("parallel scan (%s) n=%d t=%d", hamm64ScanKernel(), _numHashes, p.dctThresh);
+
+  return scanParallel(0, _numHashes, DctHashParallelChunk,
+                      [&](int begin, int end, QVector<Index::Match>& out) {
+                        std::vector<HammMatch> matches;
+                        hamm64Scan(target, _hashes + begin, size_t(end - begin), p.dctThresh,
+                                   matches);
+                        for (const HammMatch& match : matches) {
+                          uint32_t id = _mediaId[size_t(begin) + match.index];
+                          if (id != 0) out.append(Index::Match(id, match.distance));
+                        }
+                      });
+}
+
+bool DctHashIndex::findPairs(const SearchParams& p, QVector<Index::Pair>& pairs) {
+  // needles without a hash are skipped by find(), so skip them here
+  std::vector<uint32_t> ids(_mediaId, _mediaId + _numHashes);
+  for (int i = 0; i < _numHashes; ++i)
+    if (_hashes[i] == 0) ids[size_t(i)] = 0;
+
+  // separate from _mih since we need it without pending items
+  MultiIndexHash mih;
+  mih.create(_hashes, ids.data(), ids.size());
+
+  // split the buckets into chunks to run in parallel
+  const uint numChunks = 256;
+  const uint chunkSize = MultiIndexHash::NumBuckets / numChunks;
+  QVector<QVector<Index::Pair>> chunkPairs(numChunks);
+  QVector<uint> chunks;
+  for (uint i = 0; i < numChunks; ++i) chunks.append(i);
+
+  const int threshold = p.dctThresh;
+  QVector<Index::Pair>* chunkOut = chunkPairs.data();  // no detach in the threads
+  QtConcurrent::blockingMap(chunks, [&](uint chunk) {
+    QVector<Index::Pair>& out = chunkOut[chunk];
+    mih.join(threshold, chunk * chunkSize, (chunk + 1) * chunkSize,
+             [&out](uint32_t a, uint32_t b, int distance) { out.append({a, b, distance}); });
+  });
+
+  pairs.clear();
+  for (const auto& chunk : chunkPairs) pairs.append(chunk);
+
+  if (!p.filterSelf)
+    for (uint32_t id : ids)
+      if (id) pairs.append({id, id, 0});
+
+  if (p.verbose) qInfo("join n=%d t=%d pairs=%d", _numHashes, threshold, int(pairs.count()));
+  return true;
+}
+
+MultiIndexHash* DctHashIndex::multiIndexHash() {
+  QMutexLocker locker(&_mihMutex);
+  if (!_mih) {
+    _mih = new MultiIndexHash;
+    _mih->create(_hashes, _mediaId, size_t(_numHashes));
   }
-// todo: maybe use brute if threshold is high
-#if 1
-  results = _tree->search(target, p.dctThresh);
-#else
-  // brute-force search is often fast enough
-  for (int i = 0; i < _numHashes; i++) {
-    int score = hamm64(target, _hashes[i]);
-    if (score < p.dctThresh) {
-      uint32_t id = _mediaId[i];
-      if (id != 0) results.append(Index::Match(id, score));
+  return _mih;
+}
+
+QVector<QVector<Index::Match>> DctHashIndex::findBatch(const MediaGroup& needles,
+                                                       const SearchParams& p) {
+  QVector<QVector<Index::Match>> results(needles.count());
+
+  std::vector<uint64_t> targets;  // needles that have a hash
+  std::vector<int> needleIndex;   // index in needles of each target
+  for (int i = 0; i < needles.count(); ++i) {
+    uint64_t target = hashForMedia(needles[i]);
+    if (!target) {
+      qWarning() << "no hash for needle:" << needles[i].path();
+      continue;
     }
+    targets.push_back(target);
+    needleIndex.push_back(i);
   }
-#endif
+  if (targets.empty()) return results;
+
+  const int engine = searchEngine(_numHashes, p);
+
+  if (p.verbose) {
+    static const char* names[] = {"auto", "tree", "scan", "mih"};
+    qInfo("%s (%s) n=%d t=%d needles=%d", names[engine], hamm64ScanKernel(), _numHashes,
+          p.dctThresh, int(targets.size()));
+  }
+
+  if (engine == SearchParams::DctEngineMih) {
+    const MultiIndexHash* mih = multiIndexHash();
+    std::vector<MultiIndexHash::Match> matches;
+    for (size_t i = 0; i < targets.size(); ++i) {
+      matches.clear();
+      mih->search(targets[i], p.dctThresh, matches);
+      auto& result = results[needleIndex[i]];
+      result.reserve(int(matches.size()));
+      for (const auto& match : matches) result.append(Index::Match(match.index, match.distance));
+    }
+  } else if (engine == SearchParams::DctEngineTree) {
+    if (!_tree) {
+      qWarning() << "empty/null tree";
+      return results;
+    }
+    const auto batch = _tree->search(targets, p.dctThresh);
+    for (size_t i = 0; i < targets.size(); ++i) {
+      auto& result = results[needleIndex[i]];
+      // some tree variants return removed (zero) ids
+      for (const Index::Match& match : batch[int(i)])
+        if (match.mediaId != 0) result.append(match);
+    }
+  } else {
+    // scan the hashes in blocks that stay in cache for all the needles,
+    // instead of streaming the whole array once per needle
+    const size_t blockSize = 8192;
+    std::vector<HammMatch> matches;
+    for (size_t start = 0; start < size_t(_numHashes); start += blockSize) {
+      const size_t count = std::min(blockSize, size_t(_numHashes) - start);
+      for (size_t i = 0; i < targets.size(); ++i) {
+        matches.clear();
+        hamm64Scan(targets[i], _hashes + start, count, p.dctThresh, matches);
+        auto& result = results[needleIndex[i]];
+        for (const HammMatch& match : matches) {
+          uint32_t id = _mediaId[start + match.index];
+          if (id != 0) result.append(Index::Match(id, match.distance));
+        }
+      }
+    }
+  }
+
   return results;
 }
 
@@ -25,6 +25,12 @@
 /**
  * @class DctHashIndex
  * @brief Index for 64-bit dct hash that uses hamming distance
+ *
+ * The hashes, media ids and tree are saved to a flat file in the cache
+ * directory, which is memory-mapped on the next load instead of querying sql.
+ *
+ * Searches use the tree, a brute-force scan, or multi-index hashing
+ * depending on SearchParams::dctEngine.
  */
 class DctHashIndex : public Index {
   Q_DISABLE_COPY_MOVE(DctHashIndex)
@@ -37,14 +43,26 @@ class DctHashIndex : public Index {
   bool isLoaded() const override { return _isLoaded; }
   int count() const override { return _numHashes; }
   size_t memoryUsage() const override;
+  size_t wastedMemory() const override;
+
+  /// @return bytes used by the tree and multi-index hash, included in memoryUsage()
+  size_t treeMemoryUsage() const;
+  size_t mihMemoryUsage() const;
 
   void add(const MediaGroup& media) override;
   void remove(const QVector<int>& ids) override;
+  void compact(QSqlDatabase& db, const QString& cachePath) override;
+  bool hasCompact() const override { return true; }
 
   void load(QSqlDatabase& db, const QString& cacheFile, const QString& dataPath) override;
   void save(QSqlDatabase& db, const QString& cachePath) override;
 
   QVector<Index::Match> find(const Media& m, const SearchParams& p) override;
+  QVector<QVector<Index::Match>> findBatch(const MediaGroup& needles,
+                                           const SearchParams& p) override;
+  QVector<Index::Match> findNearest(const Media& m, const SearchParams& p) override;
+  QVector<Index::Match> findParallel(const Media& m, const SearchParams& p) override;
+  bool findPairs(const SearchParams& p, QVector<Index::Pair>& pairs) override;
 
   Index* slice(const QSet<uint32_t>& mediaIds) const override;
 
@@ -53,11 +71,20 @@ class DctHashIndex : public Index {
 
  private:
   void unload();
+  bool loadCache(const QString& path);
+  void writeCache(const QString& path);
+  void detach();
+  void compactArrays();
+  class MultiIndexHash* multiIndexHash();
   class DctTree* _tree;
+  class MultiIndexHash* _mih;  // built on first search with DctEngineMih
+  QMutex _mihMutex;
   uint64_t* _hashes;
   uint32_t* _mediaId;
   int _numHashes;
+  int _numRemoved;  // items in _hashes/_mediaId with id 0
   bool _isLoaded;
+  QFile* _cacheFile;  // if non-null, _hashes, _mediaId and _tree are mapped from it
   void init();
   void buildTree();
 };
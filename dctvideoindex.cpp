@@ -20,72 +20,393 @@
    <https://www.gnu.org/licenses/>.  */
 #include "dctvideoindex.h"
 
+#include "ioutil.h"
 #include "profile.h"
+#include "qtutil.h"
 #include "tree/hammingtree.h"
+#include "videohashstore.h"
+
+/// Hashes with fewer 0's or 1's than this lack detail and are not indexed
+static constexpr int DctVideoMinBits = 5;
+
+/// Minimum needle hashes searched by one thread in findVideo()
+static constexpr int DctVideoMinChunkSize = 64;
+
+/// Width of the offset (dstFrame - srcFrame) histogram bins for alignment
+static constexpr int DctVideoAlignBin = 16;
+
+/// Minimum videos loaded by one thread in buildTree()
+static constexpr int DctVideoMinLoadChunk = 16;
+
+/// Byte budget of single-video trees (SearchParams::target) kept for reuse
+static constexpr qsizetype DctVideoTreeCacheBytes = qsizetype(256) << 20;
+
+/// Gap in source frames that splits an aligned segment
+static constexpr int DctVideoAlignGap = 1000;
+
+/**
+ * Vote for the alignment of a candidate video
+ * @details Frames of a matching segment have about the same offset,
+ *          so the segments are the peaks of a histogram of offsets
+ *          (Hough transform of the diagonals in the src/dst frame plane)
+ */
+struct AlignVote {
+  uint32_t mediaIndex;  // candidate
+  int src, dst;
+};
+
+/// @return histogram bin of the vote's offset
+static inline int alignBin(const AlignVote& v) {
+  const int offset = v.dst - v.src;
+  return offset >= 0 ? offset / DctVideoAlignBin
+                     : -((-offset + DctVideoAlignBin - 1) / DctVideoAlignBin);
+}
+
+/// Offset histogram of one candidate, buffers are reused for the next
+struct AlignHistogram {
+  std::vector<int> count;  // votes in each bin
+  std::vector<char> used;  // bin is part of a segment already found
+
+  /// @return votes of bin i, 0 if it is out of range or used
+  int votes(int i) const {
+    return i >= 0 && i < int(count.size()) && !used[size_t(i)] ? count[size_t(i)] : 0;
+  }
+};
+
+/**
+ * Align one candidate and append its match, if any
+ * @param votes votes of the candidate, sorted by source frame then destination frame
+ * @details Up to SearchParams::maxSegments segments (histogram peaks) are merged
+ *          into one match; the score counts the votes of every segment and the
+ *          range is of the longest. The peak grows into adjacent bins with enough
+ *          votes, so the offset may drift (frame rate change, speed up).
+ *
+ *          If no segment is accepted, fall back to counting ascending frames
+ *          over all of the votes, which also accepts warped or shuffled copies.
+ */
+static void alignVotes(uint32_t mediaId, const AlignVote* votes, size_t count,
+                       const SearchParams& params, AlignHistogram& hist,
+                       QVector<Index::Match>& results) {
+  if (count <= size_t(params.minFramesMatched)) return;
+
+  int minBin = INT_MAX, maxBin = INT_MIN;
+  for (size_t i = 0; i < count; ++i) {
+    const int bin = alignBin(votes[i]);
+    minBin = std::min(minBin, bin);
+    maxBin = std::max(maxBin, bin);
+  }
+  const int numBins = maxBin - minBin + 1;
+  hist.count.assign(size_t(numBins), 0);
+  hist.used.assign(size_t(numBins), 0);
+  for (size_t i = 0; i < count; ++i) hist.count[size_t(alignBin(votes[i]) - minBin)]++;
+
+  auto srcLess = [](const AlignVote& v, int src) { return v.src < src; };
+  auto srcGreater = [](int src, const AlignVote& v) { return src < v.src; };
+
+  int numSegments = 0, totalNum = 0, totalInRange = 0;
+  Index::Match im;
+  im.mediaId = mediaId;
+
+  while (numSegments < params.maxSegments) {
+    // the peak includes its neighbors, for offsets near the bin edge
+    int peak = -1, peakSupport = 0;
+    for (int i = 0; i < numBins; ++i) {
+      if (hist.used[size_t(i)]) continue;
+      const int support = hist.votes(i - 1) + hist.votes(i) + hist.votes(i + 1);
+      if (support > peakSupport ||
+          (support == peakSupport && peak >= 0 && hist.votes(i) > hist.votes(peak))) {
+        peak = i;
+        peakSupport = support;
+      }
+    }
+    if (peak < 0 || peakSupport <= params.minFramesMatched) break;
+
+    // grow into neighbors that are not much smaller than the peak
+    const int peakVotes = hist.votes(peak);
+    int first = hist.votes(peak - 1) ? peak - 1 : peak;
+    int last = hist.votes(peak + 1) ? peak + 1 : peak;
+    while (hist.votes(first - 1) && hist.votes(first - 1) * 8 >= peakVotes) first--;
+    while (hist.votes(last + 1) && hist.votes(last + 1) * 8 >= peakVotes) last++;
+    for (int i = first; i <= last; ++i) hist.used[size_t(i)] = 1;
+
+    // votes are in source order, split where the source has a gap,
+    // e.g. the same clip used twice
+    const int firstBin = first + minBin, lastBin = last + minBin;
+    const AlignVote* in = nullptr;
+    const AlignVote* out = nullptr;
+    int num = 0;
+    for (size_t i = 0; i <= count && numSegments < params.maxSegments; ++i) {
+      const AlignVote* v = nullptr;
+      if (i < count) {
+        const int bin = alignBin(votes[i]);
+        if (bin < firstBin || bin > lastBin) continue;
+        v = &votes[i];
+        if (in && v->src - out->src <= DctVideoAlignGap) {
+          out = v;
+          num++;
+          continue;
+        }
+      }
+
+      if (in) {
+        // percent of all votes in the source range that agree with the alignment
+        const int numInRange = int(std::upper_bound(votes, votes + count, out->src, srcGreater) -
+                                   std::lower_bound(votes, votes + count, in->src, srcLess));
+        const int percentNear = num * 100 / numInRange;
+        const int len = std::max(out->src - in->src, out->dst - in->dst);
+
+        if (num > params.minFramesMatched && percentNear > params.minFramesNear) {
+          if (numSegments == 0 || len > im.range.len) im.range = MatchRange(in->src, in->dst, len);
+          totalNum += num;
+          totalInRange += numInRange;
+          numSegments++;
+        } else if (params.verbose) {
+          qInfo() << "reject id" << mediaId << "offset:" << (in->dst - in->src)
+                  << "matches:" << num << "%nearby:" << percentNear;
+        }
+      }
+
+      in = out = v;
+      num = 1;
+    }
+  }
+
+  if (numSegments > 0) {
+    im.score = 100 - totalNum * 100 / totalInRange;
+    results.append(im);
+    return;
+  }
+
+  // we sorted by src frame, we would expect all matches
+  // to also be in ascending order
+  int numAscending = 0;
+  int lastFrame = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (votes[i].dst > lastFrame) numAscending++;
+    lastFrame = votes[i].dst;
+  }
+
+  const int percentNear = numAscending * 100 / int(count);
+  if (percentNear > params.minFramesNear) {
+    const AlignVote& in = votes[0];
+    const AlignVote& out = votes[count - 1];
+    im.score = 100 - percentNear;
+    im.range = MatchRange(in.src, in.dst, std::max(out.src - in.src, out.dst - in.dst));
+    results.append(im);
+  } else if (params.verbose) {
+    qInfo() << "reject id" << mediaId << "matches:" << count << "%nearby:" << percentNear;
+  }
+}
+
+/**
+ * Cache file header
+ * @details followed by mediaIds[numVideos] (the media index of the tree),
+ *          videoRows[numVideos+1], frames[numRows], then tree data at treeOffset
+ */
+struct DctVideoCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t numVideos;
+  uint64_t numRows;
+  uint64_t treeOffset;
+  uint64_t treeLength;
+};
+
+static constexpr char DctVideoCacheMagic[8] = {'c', 'b', 'd', 'c', 't', 'v', 'i', 'd'};
+static constexpr uint32_t DctVideoCacheVersion = 2;
 
 DctVideoIndex::DctVideoIndex() {
   _id = SearchParams::AlgoVideo;
   _tree = nullptr;
+  _cacheFile = nullptr;
   _isLoaded = false;
+  _videoTrees.setMaxCost(DctVideoTreeCacheBytes);
 }
 
-DctVideoIndex::~DctVideoIndex() {
+DctVideoIndex::~DctVideoIndex() { deleteTree(); }
+
+void DctVideoIndex::deleteTree() {
   delete _tree;
-  for (auto it : _cachedIndex) delete it.second;
+  _tree = nullptr;
+  delete _cacheFile;  // after the tree, which may use the mapping
+  _cacheFile = nullptr;
+  _treeFrames = std::vector<uint32_t>();
+  _videoRows = std::vector<uint32_t>();
+}
+
+DctVideoIndex::TreeFrame DctVideoIndex::treeFrame(uint32_t index) const {
+  const uint32_t row = index - 1;
+  Q_ASSERT(row < _treeFrames.size());
+
+  // last video starting at or before the row, empty videos have the same start
+  auto it = std::upper_bound(_videoRows.begin(), _videoRows.end(), row);
+  return {uint32_t(it - _videoRows.begin()) - 1, _treeFrames[row]};
 }
 
 bool DctVideoIndex::isLoaded() const { return _isLoaded; }
 
 int DctVideoIndex::count() const { return _tree ? int(_tree->size()) : 0; }
 
-size_t DctVideoIndex::memoryUsage() const { return _tree ? _tree->stats().memory : 0; }
+size_t DctVideoIndex::memoryUsage() const {
+  size_t bytes = 0;
+  {
+    QMutexLocker locker(&_videoTreesMutex);
+    bytes += size_t(_videoTrees.totalCost());
+  }
+  if (!_tree) return bytes;
+  return bytes + _tree->stats().memory + VECTOR_SIZE(_treeFrames) + VECTOR_SIZE(_videoRows);
+}
 
-void DctVideoIndex::insertHashes(int mediaIndex, HammingTree* tree, const SearchParams& params) {
-  QString indexPath = QString("%1/%2.vdx").arg(_dataPath).arg(_mediaId[uint32_t(mediaIndex)]);
-  if (!QFileInfo(indexPath).exists()) {
-    qWarning() << "index file missing:" << indexPath;
-    return;
+QSharedPointer<const HammingTree> DctVideoIndex::videoTree(uint32_t mediaIndex,
+                                                           const SearchParams& params) {
+  const uint32_t mediaId = _mediaId[mediaIndex];
+  {
+    QMutexLocker locker(&_videoTreesMutex);
+    const VideoTree* cached = _videoTrees.object(mediaId);  // also marks it recently used
+    if (cached && cached->skipFrames == params.skipFrames) return cached->tree;
   }
 
-  VideoIndex index;
-  index.load(indexPath);
+  // build without the lock, so searches of other videos are not blocked;
+  // if two threads build the same tree the last one is cached
+  if (params.verbose) qInfo("build single video index");
+
+  std::vector<uint64_t> hashes;
+  std::vector<uint32_t> frames;
+  loadHashes(int(mediaIndex), hashes, frames, params);
+  for (uint32_t& frame : frames) frame++;
+
+  HammingTree* tree = new HammingTree;
+  tree->build(hashes, frames);
+  const qsizetype bytes = qsizetype(tree->stats().memory);
+  QSharedPointer<const HammingTree> ref(tree);
+
+  QMutexLocker locker(&_videoTreesMutex);
+  // evicts least recently used trees over budget, a tree larger than the
+  // whole budget is not cached (deleted by insert(), but we still hold ref)
+  _videoTrees.insert(mediaId, new VideoTree{ref, params.skipFrames}, bytes);
+  return ref;
+}
+
+void DctVideoIndex::setVideoTreeBudget(qsizetype bytes) {
+  QMutexLocker locker(&_videoTreesMutex);
+  _videoTrees.setMaxCost(bytes);
+}
+
+void DctVideoIndex::loadHashes(int mediaIndex, std::vector<uint64_t>& hashes,
+                               std::vector<uint32_t>& frames, const SearchParams& params) {
+  const uint32_t mediaId = _mediaId[uint32_t(mediaIndex)];
+  VideoHashStore::View index;
+  if (!_store->view(mediaId, index)) {
+    qWarning() << "video hashes missing for id:" << mediaId;
+    return;
+  }
+  if (index.count == 0) return;
 
-  std::vector<HammingTree::Value> values;
-  for (size_t j = 0; j < index.hashes.size(); j++) {
+  for (uint32_t j = 0; j < index.count; j++) {
     // drop hashes with < 5 0's or 1's (insufficient detail)
     // todo: figure out what value is reasonable
     // todo: drop these when creating the index
     uint64_t hash = index.hashes[j];
-    if (hamm64(hash, 0) < 5 || hamm64(hash, 0xFFFFFFFFFFFFFFFF) < 5) continue;
+    if (hamm64(hash, 0) < DctVideoMinBits || hamm64(hash, 0xFFFFFFFFFFFFFFFF) < DctVideoMinBits)
+      continue;
 
     // drop begin/end frames if there are enough left over
-    int lastFrame = index.frames[index.frames.size() - 1];
+    int lastFrame = int(index.frames[index.count - 1]);
     if (lastFrame > (params.skipFrames * 2)) {
-      if (index.frames[j] < params.skipFrames || index.frames[j] > lastFrame - params.skipFrames)
-        continue;
+      const int frame = int(index.frames[j]);
+      if (frame < params.skipFrames || frame > lastFrame - params.skipFrames) continue;
     }
 
-    // the index is a composite of the media index (not id) and
-    // the frame number corresponding to the stored hash. to get back
-    // to the mediaId use _mediaId array
-    uint32_t treeIndex = (uint32_t(mediaIndex) << 16) | index.frames[j];
-
-    values.push_back(HammingTree::Value(treeIndex, index.hashes[j]));
+    hashes.push_back(index.hashes[j]);
+    frames.push_back(index.frames[j]);
   }
-
-  tree->insert(values);
 }
 
 void DctVideoIndex::buildTree(const SearchParams& params) {
   Q_ASSERT(isLoaded());
 
-  if (_tree) return;
-
+  // always lock, so _tree is seen complete by every thread that returns
   QMutexLocker locker(&_mutex);
 
   if (!_tree) {
+    // the tree depends on the database and parameters that filter hashes,
+    // if any changed there is a different or stale cache file
+    const QString path = cacheFile(params);
+    if (!path.isEmpty() && !DBHelper::isCacheFileStale(_dbPath, path) && loadCache(path)) {
+      qInfo("from cache");
+      return;
+    }
+
+    // load and filter ranges of videos in parallel, each into its own
+    // buffers, which are concatenated in media index order
+    struct LoadChunk {
+      std::vector<uint64_t> hashes;
+      std::vector<uint32_t> frames;
+      std::vector<uint32_t> counts;  // number of rows of each video
+    };
+
+    const size_t numVideos = _mediaId.size();
+    const size_t numThreads = size_t(std::max(1, QThreadPool::globalInstance()->maxThreadCount()));
+    const size_t chunkSize =
+        std::max(size_t(DctVideoMinLoadChunk), numVideos / (numThreads * 4) + 1);
+    const int numChunks = int((numVideos + chunkSize - 1) / chunkSize);
+
+    std::vector<LoadChunk> loaded(size_t(numChunks));
+    QAtomicInt numLoaded;
+
+    auto loadChunk = [&](int chunk) {
+      LoadChunk& out = loaded[size_t(chunk)];
+      const size_t begin = size_t(chunk) * chunkSize;
+      const size_t end = std::min(begin + chunkSize, numVideos);
+      out.counts.reserve(end - begin);
+      for (size_t i = begin; i < end; ++i) {
+        const size_t before = out.hashes.size();
+        loadHashes(int(i), out.hashes, out.frames, params);
+        out.counts.push_back(uint32_t(out.hashes.size() - before));
+
+        const int n = numLoaded.fetchAndAddRelaxed(1) + 1;
+        if (n % 100 == 0 || n == int(numVideos))
+          qInfo("loading video hashes:<PL> %d/%d", n, int(numVideos));
+      }
+    };
+
+    // blocking, so the calling thread also runs chunks; this may be a pool
+    // thread (Database::similar) while the others wait for the lock
+    QVector<int> chunks;
+    for (int i = 0; i < numChunks; ++i) chunks.append(i);
+    QtConcurrent::blockingMap(chunks, loadChunk);
+
+    size_t numRows = 0;
+    for (const LoadChunk& chunk : loaded) numRows += chunk.hashes.size();
+    if (numRows >= UINT32_MAX)
+      qFatal("maximum of %u video hashes can be searched", UINT32_MAX - 1);
+
+    // rows of each video are contiguous, so the media index of a row
+    // is found from the first row of each video
+    std::vector<uint64_t> hashes;
+    std::vector<uint32_t> frames, videoRows;
+    hashes.reserve(numRows);
+    frames.reserve(numRows);
+    videoRows.reserve(numVideos + 1);
+    for (LoadChunk& chunk : loaded) {
+      uint32_t row = uint32_t(hashes.size());
+      for (uint32_t count : chunk.counts) {
+        videoRows.push_back(row);
+        row += count;
+      }
+      hashes.insert(hashes.end(), chunk.hashes.begin(), chunk.hashes.end());
+      frames.insert(frames.end(), chunk.frames.begin(), chunk.frames.end());
+      chunk = LoadChunk();
+    }
+    videoRows.push_back(uint32_t(hashes.size()));
+
+    std::vector<uint32_t> indices(hashes.size());
+    for (size_t i = 0; i < indices.size(); ++i) indices[i] = uint32_t(i + 1);
+
     auto* tree = new HammingTree;
-    for (size_t i = 0; i < _mediaId.size(); i++) insertHashes(int(i), tree, params);
+    tree->build(hashes, indices);
+    _treeFrames = std::move(frames);
+    _videoRows = std::move(videoRows);
 
     HammingTree::Stats stats = tree->stats();
     qInfo("%d/%d hashes %.1f MB, nodes=%d maxHeight=%d vtrim=%d", int(tree->size()),
@@ -93,12 +414,120 @@ void DctVideoIndex::buildTree(const SearchParams& params) {
           params.skipFrames);
 
     _tree = tree;
+
+    // written now rather than save(), which does not know the parameters
+    if (!path.isEmpty()) writeCache(path);
   }
 }
 
+QString DctVideoIndex::cacheFile(const SearchParams& params) const {
+  if (_cachePath.isEmpty()) return QString();
+  return qq("%1/dctvideo-%2-%3.cache").arg(_cachePath).arg(params.skipFrames).arg(DctVideoMinBits);
+}
+
+bool DctVideoIndex::loadCache(const QString& path) {
+  QFile* file = new QFile(path);
+  if (!file->open(QFile::ReadOnly)) {
+    qWarning() << "cache: open failed:" << file->errorString();
+    delete file;
+    return false;
+  }
+
+  DctVideoCacheHeader header;
+  const qint64 size = file->size();
+  uchar* ptr = nullptr;
+
+  if (size >= qint64(sizeof(header)))
+    // private mapping since HammingTree::map() wants writable data
+    ptr = file->map(0, size, QFileDevice::MapPrivateOption);
+
+  if (ptr) memcpy(&header, ptr, sizeof(header));
+
+  const uint64_t numElements = ptr ? 2 * uint64_t(header.numVideos) + 1 + header.numRows : 0;
+  const uint64_t arraysEnd = sizeof(header) + sizeof(uint32_t) * numElements;
+
+  if (!ptr || memcmp(header.magic, DctVideoCacheMagic, sizeof(header.magic)) != 0 ||
+      header.version != DctVideoCacheVersion || header.numRows >= UINT32_MAX ||
+      header.treeOffset < arraysEnd || header.treeOffset + header.treeLength != uint64_t(size)) {
+    qWarning() << "cache: ignoring invalid or old version:" << path;
+    delete file;
+    QFile::remove(path);
+    return false;
+  }
+
+  // tree indices refer to the media index, which must not have changed
+  const auto* ids = reinterpret_cast<const uint32_t*>(ptr + sizeof(header));
+  if (header.numVideos != _mediaId.size() ||
+      !std::equal(ids, ids + header.numVideos, _mediaId.begin())) {
+    qWarning() << "cache: ignoring stale file:" << path;
+    delete file;
+    QFile::remove(path);
+    return false;
+  }
+
+  const uint32_t* rows = ids + header.numVideos;
+  const uint32_t* frames = rows + header.numVideos + 1;
+  bool valid = rows[0] == 0 && rows[header.numVideos] == header.numRows;
+  for (uint32_t i = 0; valid && i < header.numVideos; ++i) valid = rows[i] <= rows[i + 1];
+
+  auto* tree = new HammingTree;
+  if (!valid ||
+      !tree->map(reinterpret_cast<char*>(ptr + header.treeOffset), header.treeLength)) {
+    qWarning() << "cache: ignoring invalid tree:" << path;
+    delete tree;
+    delete file;
+    QFile::remove(path);
+    return false;
+  }
+
+  _tree = tree;
+  _cacheFile = file;
+  _videoRows.assign(rows, rows + header.numVideos + 1);
+  _treeFrames.assign(frames, frames + header.numRows);
+  return true;
+}
+
+void DctVideoIndex::writeCache(const QString& path) const {
+  qInfo() << "save tree";
+  writeFileAtomically(path, [this](QFile& f) {
+    DctVideoCacheHeader header;
+    memcpy(header.magic, DctVideoCacheMagic, sizeof(header.magic));
+    header.version = DctVideoCacheVersion;
+    header.numVideos = uint32_t(_mediaId.size());
+    header.numRows = _treeFrames.size();
+    Q_ASSERT(_videoRows.size() == _mediaId.size() + 1);
+
+    // tree is aligned for the mapping
+    const qint64 idsLen = qint64(sizeof(uint32_t) * _mediaId.size());
+    const qint64 rowsLen = qint64(sizeof(uint32_t) * _videoRows.size());
+    const qint64 framesLen = qint64(sizeof(uint32_t) * _treeFrames.size());
+    const uint64_t arraysEnd = sizeof(header) + uint64_t(idsLen + rowsLen + framesLen);
+    header.treeOffset = (arraysEnd + 63) & ~uint64_t(63);
+    header.treeLength = 0;
+
+    const QByteArray padding(int(header.treeOffset - arraysEnd), 0);
+
+    if (f.write(reinterpret_cast<const char*>(&header), sizeof(header)) != sizeof(header) ||
+        f.write(reinterpret_cast<const char*>(_mediaId.data()), idsLen) != idsLen ||
+        f.write(reinterpret_cast<const char*>(_videoRows.data()), rowsLen) != rowsLen ||
+        f.write(reinterpret_cast<const char*>(_treeFrames.data()), framesLen) != framesLen ||
+        f.write(padding) != padding.length())
+      throw f.errorString();
+
+    _tree->write(f);
+
+    // now we know the tree length, update the header
+    header.treeLength = uint64_t(f.pos()) - header.treeOffset;
+    if (!f.seek(0) ||
+        f.write(reinterpret_cast<const char*>(&header), sizeof(header)) != sizeof(header))
+      throw f.errorString();
+  });
+}
+
 void DctVideoIndex::load(QSqlDatabase& db, const QString& cachePath, const QString& dataPath) {
-  (void)cachePath;
-  _dataPath = dataPath;
+  _store.reset(new VideoHashStore(dataPath));
+  _cachePath = cachePath;
+  _dbPath = db.databaseName();
 
   uint64_t start = nanoTime();
 
@@ -111,15 +540,12 @@ void DctVideoIndex::load(QSqlDatabase& db, const QString& cachePath, const QStri
 
   if (!query.exec()) SQL_FATAL(exec);
 
-  delete _tree;
-  _tree = nullptr;
+  deleteTree();
   _mediaId.clear();
   _isLoaded = false;
 
   while (query.next()) _mediaId.push_back(query.value(0).toUInt());
 
-  if (_mediaId.size() > 0xFFFF) qFatal("maximum of %d videos can be searched", 0xFFFF);
-
   // lazy load the tree since findFrame may not need it
   _isLoaded = true;
 
@@ -128,34 +554,32 @@ void DctVideoIndex::load(QSqlDatabase& db, const QString& cachePath, const QStri
 }
 
 void DctVideoIndex::save(QSqlDatabase& db, const QString& cachePath) {
+  // the tree cache is written by buildTree(), which has the search parameters
   (void)db;
   (void)cachePath;
 }
 
 void DctVideoIndex::add(const MediaGroup& media) {
+  _store->reload();  // Database committed the new videos
   for (auto& m : media) _mediaId.push_back(m.id());
-  delete _tree;
-  _tree = nullptr;
+  deleteTree();
 }
 
 void DctVideoIndex::remove(const QVector<int>& ids) {
+  _store->reload();
   QSet<int> set;
   for (auto& id : ids) set.insert(id);
 
   decltype(_mediaId) copy;
   for (auto& id : qAsConst(_mediaId))
-    if (!set.contains(id)) {
-      copy.push_back(id);
-    } else {
-      auto it = _cachedIndex.find(id);
-      if (it != _cachedIndex.end()) {
-        _cachedIndex.erase(it);
-        delete it->second;
-      }
-    }
+    if (!set.contains(id)) copy.push_back(id);
   _mediaId = copy;
-  delete _tree;
-  _tree = nullptr;
+
+  {
+    QMutexLocker locker(&_videoTreesMutex);
+    for (int id : ids) _videoTrees.remove(uint32_t(id));
+  }
+  deleteTree();
 }
 
 QVector<Index::Match> DctVideoIndex::find(const Media& needle, const SearchParams& params) {
@@ -170,33 +594,23 @@ QVector<Index::Match> DctVideoIndex::find(const Media& needle, const SearchParam
 QVector<Index::Match> DctVideoIndex::findFrame(const Media& needle, const SearchParams& params) {
   qint64 start = QDateTime::currentMSecsSinceEpoch();
 
-  const HammingTree* queryIndex = _tree;
+  const HammingTree* queryIndex = nullptr;
+  uint32_t targetIndex = 0;                     // media index of params.target
+  QSharedPointer<const HammingTree> targetTree;  // held until the search is done
 
   // optimization to search only a particular video, (future, small subset)
   if (params.target != 0) {
     if (params.verbose) qInfo("search single video");
 
-    QMutexLocker locker(&_mutex);
-
-    if (_cachedIndex[params.target])
-      queryIndex = _cachedIndex[params.target];
-    else {
-      if (params.verbose) qInfo("build single video index");
-
-      auto it = std::lower_bound(_mediaId.begin(), _mediaId.end(), params.target);
-      if (it != _mediaId.end()) {
-        int mediaIndex = int(it - _mediaId.begin());
-
-        HammingTree* tree = new HammingTree;
-        _cachedIndex[params.target] = tree;
-        insertHashes(mediaIndex, tree, params);
-        queryIndex = tree;
-      } else {
-        qWarning("unable to find the requested target id");
-        return QVector<Index::Match>();
-      }
+    auto it = std::lower_bound(_mediaId.begin(), _mediaId.end(), params.target);
+    if (it == _mediaId.end() || *it != params.target) {
+      qWarning("unable to find the requested target id");
+      return QVector<Index::Match>();
     }
+    targetIndex = uint32_t(it - _mediaId.begin());
 
+    targetTree = videoTree(targetIndex, params);
+    queryIndex = targetTree.data();
     Q_ASSERT(queryIndex);
   }
 
@@ -215,7 +629,7 @@ QVector<Index::Match> DctVideoIndex::findFrame(const Media& needle, const Search
 
   std::vector<HammingTree::Match> matches;
 
-  queryIndex->search(hash, params.dctThresh, matches);
+  queryIndex->search(hash, params.dctThresh, matches, params.treeProbes);
 
   qint64 end = QDateTime::currentMSecsSinceEpoch();
 
@@ -226,12 +640,15 @@ QVector<Index::Match> DctVideoIndex::findFrame(const Media& needle, const Search
         params.dctThresh, 0, int(matches.size()), int(end - start), double(count()) / (end - start),
         qUtf8Printable(needle.path()));
 
+  auto frameOf = [&](uint32_t index) {
+    return params.target ? TreeFrame{targetIndex, index - 1} : treeFrame(index);
+  };
+
   // get 1 nearest frame for each video matched
-  QMap<int, HammingTree::Match> nearest;
+  QMap<uint32_t, HammingTree::Match> nearest;
 
   for (const auto& match : matches) {
-    // int dstFrame   = match.index & 0xFFFF;
-    int mediaIndex = match.value.index >> 16;
+    const uint32_t mediaIndex = frameOf(match.value.index).mediaIndex;
 
     auto it = nearest.find(mediaIndex);
 
@@ -242,8 +659,9 @@ QVector<Index::Match> DctVideoIndex::findFrame(const Media& needle, const Search
   }
 
   for (const auto& match : nearest) {
-    uint32_t dstFrame = match.value.index & 0xFFFF;
-    uint32_t mediaIndex = match.value.index >> 16;
+    const TreeFrame tf = frameOf(match.value.index);
+    uint32_t dstFrame = tf.frame;
+    uint32_t mediaIndex = tf.mediaIndex;
 
     Index::Match result;
     result.mediaId = _mediaId[mediaIndex];
@@ -271,9 +689,10 @@ Index* DctVideoIndex::slice(const QSet<uint32_t>& mediaIds) const {
   DctVideoIndex* copy = new DctVideoIndex;
   // replicate what load() does, but use the subset
   // tree rebuilds on first query
-  copy->_dataPath = _dataPath;
+  copy->_store = _store;
   copy->_isLoaded = true;
   for (auto& id : mediaIds) copy->_mediaId.push_back(id);
+  std::sort(copy->_mediaId.begin(), copy->_mediaId.end());  // as if by load()
   return copy;
 }
 
@@ -285,7 +704,7 @@ QVector<Index::Match> DctVideoIndex::findVideo(const Media& needle, const Search
   if (needle.id() == 0)
     srcIndex = needle.videoIndex();
   else
-    srcIndex.load(QString("%1/%2.vdx").arg(_dataPath).arg(needle.id()));
+    _store->load(uint32_t(needle.id()), srcIndex);
 
   if (srcIndex.isEmpty()) {
     qWarning() << "needle video index is empty:" << needle.path();
@@ -295,68 +714,83 @@ QVector<Index::Match> DctVideoIndex::findVideo(const Media& needle, const Search
   buildTree(params);
   const HammingTree* queryIndex = _tree;
 
-  QMap<uint32_t, std::vector<MatchRange>> cand;
-
-  const int lastFrame = srcIndex.frames[srcIndex.frames.size() - 1];
+  // source frames to search, skipping the begin/end
+  const int lastFrame = int(srcIndex.frames[srcIndex.frames.size() - 1]);
+  std::vector<uint64_t> srcHashes;
+  std::vector<int> srcFrames;
   for (size_t i = 0; i < srcIndex.hashes.size(); i++) {
-    uint64_t hash = srcIndex.hashes[i];
-    std::vector<HammingTree::Match> matches;
-    queryIndex->search(hash, params.dctThresh, matches);
-
-    for (const HammingTree::Match& match : matches) {
-      uint32_t dstFrame = match.value.index & 0xFFFF;
-      uint32_t mediaIndex = match.value.index >> 16;
-
-      uint32_t id = _mediaId[mediaIndex];
-      if (!params.filterSelf || id != uint32_t(needle.id())) {
-        int srcFrame = srcIndex.frames[i];
-        if (srcFrame < params.skipFrames || srcFrame > (lastFrame - params.skipFrames)) continue;
+    const int srcFrame = int(srcIndex.frames[i]);
+    if (srcFrame < params.skipFrames || srcFrame > (lastFrame - params.skipFrames)) continue;
+    srcHashes.push_back(srcIndex.hashes[i]);
+    srcFrames.push_back(srcFrame);
+  }
 
-        cand[id].push_back(MatchRange(srcFrame, int(dstFrame), 1));
+  // search chunks of the needle in parallel, each chunk in one traversal
+  // of the tree; candidates of each chunk are kept in order so the result
+  // is the same as searching every hash in turn
+  typedef std::vector<AlignVote> Candidates;
+  const size_t numThreads = size_t(std::max(1, QThreadPool::globalInstance()->maxThreadCount()));
+  const size_t chunkSize =
+      std::max(size_t(DctVideoMinChunkSize), srcHashes.size() / (numThreads * 4) + 1);
+  const int numChunks = int((srcHashes.size() + chunkSize - 1) / chunkSize);
+  std::vector<Candidates> chunkCand(size_t(numChunks));
+
+  auto searchChunk = [&](int chunk) {
+    const size_t begin = size_t(chunk) * chunkSize;
+    const size_t end = std::min(begin + chunkSize, srcHashes.size());
+    const std::vector<uint64_t> hashes(srcHashes.begin() + long(begin),
+                                       srcHashes.begin() + long(end));
+
+    std::vector<std::vector<HammingTree::Match>> matches;
+    queryIndex->search(hashes, params.dctThresh, matches, params.treeProbes);
+
+    Candidates& out = chunkCand[size_t(chunk)];
+    for (size_t i = 0; i < matches.size(); i++)
+      for (const HammingTree::Match& match : matches[i]) {
+        const TreeFrame tf = treeFrame(match.value.index);
+        if (!params.filterSelf || _mediaId[tf.mediaIndex] != uint32_t(needle.id()))
+          out.push_back({tf.mediaIndex, srcFrames[begin + i], int(tf.frame)});
       }
+  };
+
+  if (numChunks > 1) {
+    QVector<int> chunks;
+    for (int i = 0; i < numChunks; ++i) chunks.append(i);
+    QtConcurrent::blockingMap(chunks, searchChunk);
+  } else if (numChunks == 1)
+    searchChunk(0);
+
+  // group the votes by candidate with a counting sort, which keeps the
+  // source frame order of the chunks
+  const size_t numVideos = _mediaId.size();
+  std::vector<uint32_t> candStart(numVideos + 1, 0);
+  for (const Candidates& chunk : chunkCand)
+    for (const AlignVote& v : chunk) candStart[v.mediaIndex + 1]++;
+  for (size_t i = 0; i < numVideos; ++i) candStart[i + 1] += candStart[i];
+
+  std::vector<AlignVote> votes(candStart[numVideos]);
+  {
+    std::vector<uint32_t> pos(candStart.begin(), candStart.end() - 1);
+    for (Candidates& chunk : chunkCand) {
+      for (const AlignVote& v : chunk) votes[pos[v.mediaIndex]++] = v;
+      chunk = Candidates();
     }
   }
 
-  for (auto it = cand.begin(); it != cand.end(); ++it) {
-    auto ranges = it.value();
-
-    std::sort(ranges.begin(), ranges.end());
-
-    int num = int(ranges.size());  // number of frames that matched
-    // int min = matches.front().srcIn; // frame number of first match
-    // int max = matches.back().srcIn;  // frame number of last match
-
-    // we sorted by src frame, we would expect all matches
-    // to also be in ascending order
-    int numAscending = 0;
-    int lastFrame = 0;
-    for (const MatchRange& range : ranges) {
-      int frame = range.dstIn;
-      // fixme: small # of back frames are also valid
-      // should all neighboring frames be checked with hamming?
-      if (frame > lastFrame) numAscending++;
-      lastFrame = frame;
-    }
-
-    int percentNear = numAscending * 100 / num;
-
-    if (num > params.minFramesMatched && percentNear > params.minFramesNear) {
-      // printf("\t%d\t%d%%\n", num, percentNear);
-      Index::Match im;
-      im.mediaId = it.key();
-      im.score = 100 - percentNear;  // num;
-      im.range.srcIn = ranges.front().srcIn;
-      im.range.dstIn = it.value().front().dstIn;
-
-      int srcLen = ranges.back().srcIn - ranges.front().srcIn;
-      int dstLen = it.value().back().dstIn - it.value().front().dstIn;
-      im.range.len = std::max(srcLen, dstLen);
-
-      results.append(im);
-    } else if (params.verbose) {
-      qInfo() << "reject id" << it.key() << "matches:" << num << "%nearby:" << percentNear;
-    }
+  // a source frame may match several frames, order them too
+  auto byDst = [](const AlignVote& a, const AlignVote& b) { return a.dst < b.dst; };
+  for (size_t begin = 0, end = 0; begin < votes.size(); begin = end) {
+    while (end < votes.size() && votes[end].mediaIndex == votes[begin].mediaIndex &&
+           votes[end].src == votes[begin].src)
+      end++;
+    if (end - begin > 1) std::sort(votes.begin() + long(begin), votes.begin() + long(end), byDst);
   }
 
+  AlignHistogram hist;
+  for (size_t i = 0; i < numVideos; ++i)
+    if (candStart[i + 1] > candStart[i])
+      alignVotes(_mediaId[i], votes.data() + candStart[i], candStart[i + 1] - candStart[i],
+                 params, hist, results);
+
   return results;
 }
@@ -22,6 +22,7 @@
 #include "index.h"
 
 class HammingTree;
+class VideoHashStore;
 
 /**
  * @class DctVideoIndex
@@ -51,16 +52,48 @@ class DctVideoIndex : public Index {
   // video index does not use sql, but we need media ids
   int databaseId() const override { return 0; }
 
+  /// Set the byte budget of single-video trees (SearchParams::target), evicts if over
+  void setVideoTreeBudget(qsizetype bytes);
+
  private:
   QVector<Index::Match> findFrame(const Media& needle, const SearchParams& params);
   QVector<Index::Match> findVideo(const Media& needle, const SearchParams& params);
-  void insertHashes(int mediaIndex, HammingTree* tree, const SearchParams& params);
+  void loadHashes(int mediaIndex, std::vector<uint64_t>& hashes, std::vector<uint32_t>& frames,
+                  const SearchParams& params);
   void buildTree(const SearchParams& params);
+  void deleteTree();
+  QString cacheFile(const SearchParams& params) const;
+  bool loadCache(const QString& path);
+  void writeCache(const QString& path) const;
+
+  /// Video and frame of a hash in the tree
+  struct TreeFrame {
+    uint32_t mediaIndex;
+    uint32_t frame;
+  };
+  TreeFrame treeFrame(uint32_t index) const;
+
+  /// Tree of one video for SearchParams::target, built if it is not cached
+  QSharedPointer<const HammingTree> videoTree(uint32_t mediaIndex, const SearchParams& params);
+
+  /// Cached tree of one video, index is the frame number + 1
+  struct VideoTree {
+    QSharedPointer<const HammingTree> tree;  // searches in progress keep evicted trees
+    int skipFrames;                          // tree depends on SearchParams::skipFrames
+  };
 
+  // tree index is the row of the hash + 1 (HammingTree reserves 0), the
+  // video and frame are looked up since they do not fit in 32 bits
   HammingTree* _tree;
+  std::vector<uint32_t> _treeFrames;  // frame number of each row
+  std::vector<uint32_t> _videoRows;   // first row of each media index, then number of rows
+  QFile* _cacheFile;   // if non-null, _tree clusters are mapped from it
+  QString _cachePath;  // empty if the tree is not cached (slices)
+  QString _dbPath;     // for cache modification check
   std::vector<uint32_t> _mediaId;
-  QString _dataPath;
-  std::map<uint32_t, HammingTree*> _cachedIndex;
-  QMutex _mutex;
+  QSharedPointer<VideoHashStore> _store;  // shared with slices
+  QCache<uint32_t, VideoTree> _videoTrees;  // by media id, cost is bytes (LRU)
+  mutable QMutex _videoTreesMutex;          // guards _videoTrees only
+  QMutex _mutex;                            // guards buildTree()
   bool _isLoaded;
 };
@@ -28,6 +28,7 @@
 #include "dctvideoindex.h"
 #include "scanner.h"
 #include "templatematcher.h"
+#include "videohashstore.h"
 
 Engine::Engine(const QString& path, const IndexParams& params) {
   db = new Database(path);
@@ -152,17 +153,13 @@ void Engine::update(bool wait) {
   // todo: re-index missing item now
   if (scanner->indexParams().algos & (1 << SearchParams::AlgoVideo))
     for (const Media& m : db->mediaWithType(Media::TypeVideo)) {
-      QString vIndexPath = QString("%1/%2.vdx").arg(db->videoPath()).arg(m.id());
-      if (!QFileInfo(vIndexPath).exists()) {
+      VideoIndex idx;
+      if (!db->videoStore().load(uint32_t(m.id()), idx)) {
         qWarning() << "video index missing:" << m.path();
         toRemove.append(m.id());
-      } else {
-        VideoIndex idx;
-        idx.load(vIndexPath);
-        if (idx.isEmpty()) {
-          qWarning() << "video index is empty, forcing re-index:" << m.path();
-          toRemove.append(m.id());
-        }
+      } else if (idx.isEmpty()) {
+        qWarning() << "video index is empty, forcing re-index:" << m.path();
+        toRemove.append(m.id());
       }
     }
 
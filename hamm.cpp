@@ -0,0 +1,124 @@
+/* Fast hamming distance
+   Copyright (C) 2021 scrubbbbs
+   Contact: screubbbebs@gemeaile.com =~ s/e//g
+   Project: https://github.com/scrubbbbs/cbird
+
+   This file is part of cbird.
+
+   cbird is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   cbird is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with cbird; if not, see
+   <https://www.gnu.org/licenses/>.  */
+#include "hamm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define HAMM_X86 (1)
+#endif
+
+/// Scan hashes [start, count), also the tail of the simd kernels
+static void scanFrom(uint64_t needle, const uint64_t* hashes, size_t start, size_t count,
+                     int threshold, std::vector<HammMatch>& matches) {
+  for (size_t i = start; i < count; ++i) {
+    const int distance = hamm64(needle, hashes[i]);
+    if (distance < threshold) matches.push_back({uint32_t(i), distance});
+  }
+}
+
+static void scanScalar(uint64_t needle, const uint64_t* hashes, size_t count, int threshold,
+                       std::vector<HammMatch>& matches) {
+  scanFrom(needle, hashes, 0, count, threshold, matches);
+}
+
+#if HAMM_X86
+
+// popcount with nibble lookup table, then horizontal sum with sad
+__attribute__((target("avx2"))) static inline __m256i popcount256(__m256i x) {
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,  //
+                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i lowMask = _mm256_set1_epi8(0x0f);
+  const __m256i lo = _mm256_and_si256(x, lowMask);
+  const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), lowMask);
+  const __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+  return _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2"))) static void scanAvx2(uint64_t needle, const uint64_t* hashes,
+                                                     size_t count, int threshold,
+                                                     std::vector<HammMatch>& matches) {
+  const __m256i n = _mm256_set1_epi64x(int64_t(needle));
+  const __m256i t = _mm256_set1_epi64x(threshold);
+
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256i x0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hashes + i));
+    const __m256i x1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hashes + i + 4));
+    const __m256i d0 = popcount256(_mm256_xor_si256(x0, n));
+    const __m256i d1 = popcount256(_mm256_xor_si256(x1, n));
+    const int m0 = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(t, d0)));
+    const int m1 = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(t, d1)));
+    int mask = m0 | (m1 << 4);
+    while (Q_UNLIKELY(mask)) {
+      const size_t j = i + size_t(__builtin_ctz(uint(mask)));
+      matches.push_back({uint32_t(j), hamm64(needle, hashes[j])});
+      mask &= mask - 1;
+    }
+  }
+  scanFrom(needle, hashes, i, count, threshold, matches);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) static void scanAvx512(
+    uint64_t needle, const uint64_t* hashes, size_t count, int threshold,
+    std::vector<HammMatch>& matches) {
+  const __m512i n = _mm512_set1_epi64(int64_t(needle));
+  const __m512i t = _mm512_set1_epi64(threshold);
+
+  size_t i = 0;
+  for (; i < count; i += 8) {
+    // the last block is a masked load
+    const __mmask8 valid = count - i >= 8 ? 0xFF : __mmask8((1u << (count - i)) - 1);
+    const __m512i x = _mm512_maskz_loadu_epi64(valid, hashes + i);
+    const __m512i d = _mm512_popcnt_epi64(_mm512_xor_si512(x, n));
+    uint mask = _mm512_mask_cmplt_epu64_mask(valid, d, t);
+    while (Q_UNLIKELY(mask)) {
+      const size_t j = i + size_t(__builtin_ctz(mask));
+      matches.push_back({uint32_t(j), hamm64(needle, hashes[j])});
+      mask &= mask - 1;
+    }
+  }
+}
+
+#endif  // HAMM_X86
+
+const std::vector<Hamm64ScanKernel>& hamm64ScanKernels() {
+  static const std::vector<Hamm64ScanKernel> kernels = [] {
+    std::vector<Hamm64ScanKernel> supported;
+#if HAMM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+      supported.push_back({scanAvx512, "avx512"});
+    if (__builtin_cpu_supports("avx2")) supported.push_back({scanAvx2, "avx2"});
+#endif
+    supported.push_back({scanScalar, "scalar"});
+    return supported;
+  }();
+  return kernels;
+}
+
+void hamm64Scan(uint64_t needle, const uint64_t* hashes, size_t count, int threshold,
+                std::vector<HammMatch>& matches) {
+  if (threshold <= 0) return;
+  static const auto scan = hamm64ScanKernels().front().scan;
+  scan(needle, hashes, count, threshold, matches);
+}
+
+const char* hamm64ScanKernel() { return hamm64ScanKernels().front().name; }
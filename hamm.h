@@ -20,5 +20,35 @@
    <https://www.gnu.org/licenses/>.  */
 #pragma once
 
+#include <vector>
+
 /// 64-bit hamming distance using special x86 instruction
 inline int hamm64(uint64_t a, uint64_t b) { return __builtin_popcountll(a ^ b); } // fixme: use std::popcount() - c++20
+
+/// result of hamm64Scan()
+struct HammMatch {
+  uint32_t index;  // offset in the scanned array
+  int distance;
+};
+
+/**
+ * Brute-force search of a hash array
+ * @details Appends hashes with hamm64(needle, hash) < threshold to matches.
+ *          The widest kernel the cpu supports is chosen at startup
+ *          (AVX-512 VPOPCNTQ, AVX2, or scalar popcount)
+ */
+void hamm64Scan(uint64_t needle, const uint64_t* hashes, size_t count, int threshold,
+                std::vector<HammMatch>& matches);
+
+/// @return name of the kernel used by hamm64Scan()
+const char* hamm64ScanKernel();
+
+/// One implementation of hamm64Scan()
+struct Hamm64ScanKernel {
+  void (*scan)(uint64_t needle, const uint64_t* hashes, size_t count, int threshold,
+               std::vector<HammMatch>& matches);
+  const char* name;
+};
+
+/// @return every kernel the cpu supports, widest first; the first is used by hamm64Scan()
+const std::vector<Hamm64ScanKernel>& hamm64ScanKernels();
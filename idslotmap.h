@@ -0,0 +1,105 @@
+/* Media id to index slot lookup
+   Copyright (C) 2021 scrubbbbs
+   Contact: screubbbebs@gemeaile.com =~ s/e//g
+   Project: https://github.com/scrubbbbs/cbird
+
+   This file is part of cbird.
+
+   cbird is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   cbird is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with cbird; if not, see
+   <https://www.gnu.org/licenses/>.  */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @class IdSlotMap
+ * @brief Slot of each media id in the arrays of a flat index
+ *
+ * Media ids are database row ids, which are dense, so this is an
+ * array indexed by id rather than a hash table. Indexes that move items
+ * (compaction) must set() the new slot.
+ *
+ * A few ids from a large database (Index::slice() for -p.set) would still
+ * need an array of every id, so if the ids given to build() are sparse,
+ * a hash table is used instead.
+ */
+class IdSlotMap {
+ public:
+  enum : uint32_t { NoSlot = UINT32_MAX };
+
+  /// Replace contents, ids of 0 (removed items) are skipped
+  void build(const uint32_t* ids, size_t count) {
+    uint32_t maxId = 0;
+    for (size_t i = 0; i < count; ++i) maxId = std::max(maxId, ids[i]);
+
+    clear();
+    // the array is 4 bytes per id, a hash table about 32 per item
+    _isSparse = size_t(maxId) > count * 8;
+    if (_isSparse) {
+      _sparse.reserve(count);
+      for (size_t i = 0; i < count; ++i)
+        if (ids[i]) _sparse[ids[i]] = uint32_t(i);
+      return;
+    }
+
+    _slots.assign(count ? size_t(maxId) + 1 : 0, NoSlot);
+    for (size_t i = 0; i < count; ++i)
+      if (ids[i]) _slots[ids[i]] = uint32_t(i);
+  }
+
+  void clear() {
+    _slots = std::vector<uint32_t>();
+    _sparse = std::unordered_map<uint32_t, uint32_t>();
+    _isSparse = false;
+  }
+
+  void set(uint32_t id, uint32_t slot) {
+    if (_isSparse) {
+      _sparse[id] = slot;
+      return;
+    }
+    if (id >= _slots.size()) _slots.resize(size_t(id) + 1, NoSlot);
+    _slots[id] = slot;
+  }
+
+  void remove(uint32_t id) {
+    if (_isSparse)
+      _sparse.erase(id);
+    else if (id < _slots.size())
+      _slots[id] = NoSlot;
+  }
+
+  /// @return slot of the id, or NoSlot
+  uint32_t slot(uint32_t id) const {
+    if (_isSparse) {
+      auto it = _sparse.find(id);
+      return it != _sparse.end() ? it->second : uint32_t(NoSlot);
+    }
+    return id < _slots.size() ? _slots[id] : uint32_t(NoSlot);
+  }
+
+  /// @note hash table size is an estimate, it depends on the allocator
+  size_t memoryUsage() const {
+    return _slots.capacity() * sizeof(uint32_t) + _sparse.bucket_count() * sizeof(void*) +
+           _sparse.size() * (sizeof(std::pair<const uint32_t, uint32_t>) + sizeof(void*));
+  }
+
+ private:
+  std::vector<uint32_t> _slots;                     // slot of each id, if dense
+  std::unordered_map<uint32_t, uint32_t> _sparse;  // slot of each id, if sparse
+  bool _isSparse = false;
+};
@@ -43,6 +43,56 @@ bool SearchParams::mediaReady(const Media& needle) const {
   return ok;
 }
 
+QVector<Index::Match> Index::scanParallel(
+    int begin, int end, int chunkSize,
+    const std::function<void(int, int, QVector<Match>&)>& scan) {
+  QVector<Match> matches;
+  if (end - begin <= chunkSize) {
+    if (end > begin) scan(begin, end, matches);
+    return matches;
+  }
+
+  QVector<int> chunks;
+  for (int i = begin; i < end; i += chunkSize) chunks.append(i);
+
+  QVector<QVector<Match>> chunkMatches(chunks.count());
+  QVector<Match>* out = chunkMatches.data();  // no detach in the threads
+  QtConcurrent::blockingMap(chunks, [&](int chunkBegin) {
+    scan(chunkBegin, std::min(chunkBegin + chunkSize, end), out[(chunkBegin - begin) / chunkSize]);
+  });
+
+  for (const auto& chunk : qAsConst(chunkMatches)) matches.append(chunk);
+  return matches;
+}
+
+QVector<Index::Match> Index::findNearest(const Media& m, const SearchParams& p) {
+  QVector<Index::Match> matches = find(m, p);
+
+  // increase threshold until is match is found or maxThresh is exceeded
+  SearchParams tmp = p;
+  while (matches.count() <= p.minMatches) {
+    switch (p.algo) {
+      case SearchParams::AlgoDCT:
+      case SearchParams::AlgoDCTFeatures:
+      case SearchParams::AlgoVideo:
+        tmp.dctThresh++;
+        if (tmp.dctThresh > p.maxThresh) return matches;
+        break;
+      case SearchParams::AlgoCVFeatures:
+        tmp.cvThresh += 5;
+        if (tmp.cvThresh > p.maxThresh) return matches;
+        break;
+      case SearchParams::AlgoColor:
+        return matches;  // no thresholding
+      default:
+        qWarning() << "maxThresh: unsupported algorithm";
+        return matches;
+    }
+    matches = find(m, tmp);
+  }
+  return matches;
+}
+
 SearchParams::SearchParams() {
   static const QVector<NamedValue> emptyValues;
   static const QVector<int> emptyRange;
@@ -69,6 +119,19 @@ SearchParams::SearchParams() {
          GET(dctThresh), NO_NAMES, GET_CONST(range)});
   }
 
+  {
+    static const QVector<NamedValue> values{
+        {DctEngineAuto, "auto", "Choose tree or scan depending on threshold and index size"},
+        {DctEngineTree, "tree", "Search tree"},
+        {DctEngineScan, "scan", "Brute-force scan"},
+        {DctEngineMih, "mih", "Multi-index hashing"}};
+    add({"dhe", "DCT hash search method", Value::Enum, counter++,
+         SET_ENUM("dhe", dctEngine, values), GET(dctEngine), GET_CONST(values), NO_RANGE});
+  }
+
+  add({"dhp", "DCT hash tree probes (leaves searched, fdct/video)", Value::Int, counter++,
+       SET_INT(treeProbes), GET(treeProbes), NO_NAMES, GET_CONST(nonzero)});
+
   {
     static const QVector<int> range{0, 100};
     add({"odt", "ORB descriptor distance threshold", Value::Int, counter++, SET_INT(cvThresh),
@@ -131,6 +194,9 @@ SearchParams::SearchParams() {
   add({"vfn", "Minimum percent of frames near each other", Value::Int, counter++,
        SET_INT(minFramesNear), GET(minFramesNear), NO_NAMES, GET_CONST(percent)});
 
+  add({"vseg", "Maximum aligned segments combined into each video match", Value::Int, counter++,
+       SET_INT(maxSegments), GET(maxSegments), NO_NAMES, GET_CONST(nonzero)});
+
   add({"fg", "Filter Groups: remove duplicate groups from result: {a,b}=={b,a}", Value::Bool,
        counter++, SET_BOOL(filterGroups), GET(filterGroups), NO_NAMES, NO_RANGE});
 
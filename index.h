@@ -71,6 +71,16 @@ class SearchParams : public Params {
     FlagAudio = 1 << (Media::TypeAudio - 1)
   };
 
+  /**
+   * search methods for dct hash index
+   */
+  enum {
+    DctEngineAuto = 0,  /// Choose tree or scan with a cost model
+    DctEngineTree = 1,  /// Search tree, fast for low thresholds
+    DctEngineScan = 2,  /// Brute-force SIMD scan, fast for high thresholds
+    DctEngineMih = 3,   /// Multi-index hashing, exact and fast for moderate thresholds
+  };
+
   int algo = AlgoDCT,        // AlgoXXX
       dctThresh = 5,         // threshold for DCT hash hamming distance
       cvThresh = 25,         // threshold for ORB descriptors distance
@@ -80,7 +90,10 @@ class SearchParams : public Params {
       haystackFeatures = 1000,  // template match: number of haystack features
       mirrorMask = MirrorNone,  // MirrorXXX flags for mirror search
       maxThresh = 0,            // if > 0, increment dct/cv/Thresh < maxThresh until match is found
-      tmThresh = 5;             // threshold for template match DCT hash
+                                //   (Index::findNearest())
+      tmThresh = 5,             // threshold for template match DCT hash
+      dctEngine = DctEngineAuto,  // DctEngineXXX method for DCT hash search
+      treeProbes = 1;             // number of HammingTree leaves to search, >1 for fewer misses
 
   bool templateMatch = false,  // remove results that don't pass the template matcher
       negativeMatch = false,   // remove results in the negative matches (blacklist)
@@ -101,6 +114,7 @@ class SearchParams : public Params {
   int skipFrames = 300;       // video search: ignore first and last N frames of video
   int minFramesMatched = 30;  // video search: require >N frames match between videos
   int minFramesNear = 60;     // video search: require >N% of frames that matched are nearby
+  int maxSegments = 1;        // video search: combine up to N aligned segments per video
 
   bool filterSelf = true;       // remove media that matched itself
   bool filterGroups = true;     // remove duplicate groups from results (a matches (b,c,d)
@@ -146,6 +160,12 @@ class Index {
     Match(uint32_t mediaId_, int score_) : mediaId(mediaId_), score(score_) {}
   };
 
+  /// item type of findPairs()
+  struct Pair {
+    uint32_t a, b;  // media ids, a == b for self-match
+    int score;      // score of match, lower is better
+  };
+
   /// @return unique id (AlgoXXX enum)
   int id() const { return _id; }
 
@@ -155,6 +175,9 @@ class Index {
   /// @return amount of heap memory used
   virtual size_t memoryUsage() const = 0;
 
+  /// @return amount of memoryUsage() taken by removed items, that compact() would free
+  virtual size_t wastedMemory() const { return 0; }
+
   /**
    * @return number of items represented
    * @note could be less than number of items in database
@@ -216,6 +239,19 @@ class Index {
    */
   virtual void remove(const QVector<int>& id) = 0;
 
+  /**
+   * Free the memory taken by removed items and rewrite the cache file
+   * @note indexes may also compact in remove() once enough memory is wasted,
+   *       the cache file is then rewritten by the next save()
+   */
+  virtual void compact(QSqlDatabase& db, const QString& cachePath) {
+    Q_UNUSED(db);
+    Q_UNUSED(cachePath);
+  }
+
+  /// @return true if compact() improves something that is saved, else it is not worth loading
+  virtual bool hasCompact() const { return false; }
+
   /**
    * Find something in the index
    * @param m The query media, pre-processed for searching
@@ -223,6 +259,53 @@ class Index {
    */
   virtual QVector<Index::Match> find(const Media& m, const SearchParams& p) = 0;
 
+  /**
+   * Find at least minMatches+1 matches, if possible, without exceeding maxThresh
+   * @details The result is the same as find() with the lowest threshold
+   *          (starting at dctThresh/cvThresh) that has enough matches, or
+   *          with maxThresh if none do. The default implementation
+   *          searches again with increasing threshold, indexes with
+   *          a nearest-neighbor search should override
+   */
+  virtual QVector<Index::Match> findNearest(const Media& m, const SearchParams& p);
+
+  /**
+   * Find every pair of indexed items that match each other (self-join)
+   * @details Same result as find() on every item, with each pair once
+   *          instead of once per item. Used for -similar with no subset
+   *          or maxThresh. If !p.filterSelf, items are also paired with themselves
+   * @return false if unsupported
+   */
+  virtual bool findPairs(const SearchParams& p, QVector<Index::Pair>& pairs) {
+    Q_UNUSED(p);
+    Q_UNUSED(pairs);
+    return false;
+  }
+
+  /**
+   * Find many needles at once
+   * @details Indexes may override to share work between needles, such
+   *          as traversing the tree once for the whole batch
+   * @return matches for each needle, in the same order
+   */
+  virtual QVector<QVector<Index::Match>> findBatch(const MediaGroup& needles,
+                                                   const SearchParams& p) {
+    QVector<QVector<Index::Match>> results;
+    results.reserve(needles.count());
+    for (const Media& m : needles) results.append(find(m, p));
+    return results;
+  }
+
+  /**
+   * Find one needle with every thread
+   * @details Same result as find(), for single queries (Database::similarTo()).
+   *          Indexes that scan a flat array may override to split it
+   *          with scanParallel()
+   */
+  virtual QVector<Index::Match> findParallel(const Media& m, const SearchParams& p) {
+    return find(m, p);
+  }
+
   /**
    * Get data such as descriptors that are only stored in the index
    * @param m if m.id() exists in the index then it is populated.
@@ -246,6 +329,17 @@ class Index {
  protected:
   int _id;
   Index() { _id = -1; }
+
+  /**
+   * Scan items [begin,end) in chunks on the thread pool
+   * @details Threads take the next chunk when they finish one, so chunks
+   *          of uneven cost balance out
+   * @param scan scan(chunkBegin, chunkEnd, matches) sets the matches of one chunk,
+   *        e.g. the best k of the chunk for a top-k search
+   * @return matches of every chunk, in item order
+   */
+  static QVector<Match> scanParallel(int begin, int end, int chunkSize,
+                                     const std::function<void(int, int, QVector<Match>&)>& scan);
 };
 
 /// sort matches by score
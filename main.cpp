@@ -147,9 +147,10 @@ int printCompletions(const char* argv0, const QStringList& args) {
                      "-update", "-headless", "-dups", "-similar", "-select-none", "-select-all",
                      "-select-errors", "-first", "-chop", "-first-sibling", "-sort-similar",
                      "-remove", "-nuke", "-rename", "-sets", "-folders", "-exit-on-select", "-show",
-                     "-help", "-version", "-about", "-verify", "-vacuum", "-select-result",
-                     "-license", "-cwd", "-init", "-list-search-params", "-list-index-params",
-                     "-weeds", /*"-track-weeds",*/ "-nuke-weeds", "-dump", "-list-formats",
+                     "-help", "-version", "-about", "-verify", "-vacuum", "-compact",
+                     "-select-result", "-license", "-cwd", "-init", "-list-search-params",
+                     "-list-index-params", "-weeds", /*"-track-weeds",*/ "-nuke-weeds", "-dump",
+                     "-list-formats",
                      /* one argument */
                      "-select-id", "-select-sql", "-max-per-page", "-head", "-tail", "-theme"};
 
@@ -1426,6 +1427,8 @@ int main(int argc, char** argv) {
       _commands.testCsv(engine(), nextArg());
     } else if (arg == "-vacuum") {
       engine().db->vacuum();
+    } else if (arg == "-compact") {
+      engine().db->compact();
     } else if (arg == "-test-add-video") {
       IndexResult result = engine().scanner->processVideoFile(nextArg());
       MediaGroup media{result.media};
@@ -789,7 +789,7 @@ void Media::makeVideoIndex(VideoContext& video, int threshold, VideoIndex& outIn
     autocrop(img, 20);
     uint64_t hash = dctHash64(img);
     index.hashes.push_back(hash);
-    index.frames.push_back(numFrames & 0xFFFF);
+    index.frames.push_back(uint32_t(numFrames));
     numFrames++;
   }
 
@@ -820,88 +820,61 @@ void Media::makeVideoIndex(VideoContext& video, int threshold, VideoIndex& outIn
       if (close != window.size()) {
         window.clear();
         index.hashes.push_back(hash);
-        index.frames.push_back(numFrames & 0xFFFF);
+        index.frames.push_back(uint32_t(numFrames));
       } else
         nearFrames++;
 
       window.push_back(hash);
     } else {
       index.hashes.push_back(hash);
-      index.frames.push_back(numFrames & 0xFFFF);
+      index.frames.push_back(uint32_t(numFrames));
     }
 
     numFrames++;
     curFrames++;
-
-    if (numFrames > 0xFFFF) {
-      qCritical() << _path << "greater than 64k frames unsupported, quitting";
-      break;
-    }
   }
 
   // always include the last frame so it can be used as a reference
-  if (index.frames.size() > 0 && index.frames.back() != numFrames - 1) {
+  if (index.frames.size() > 0 && index.frames.back() != uint32_t(numFrames - 1)) {
     index.hashes.push_back(window.back());
-    index.frames.push_back((numFrames - 1) & 0xFFFF);
+    index.frames.push_back(uint32_t(numFrames - 1));
   }
 
   qDebug("%s nframes=%d near=%d filt=%d corrupt=%d", qUtf8Printable(video.path()), numFrames,
          nearFrames, filteredFrames, corruptFrames);
 }
 
-void VideoIndex::save(const QString& file) const {
-  MessageContext ctx(file);
-  FILE* indexFile = fopen(qUtf8Printable(file), "wb");
-  if (!indexFile) qFatal("failed to open");
-
-  uint16_t numFrames = frames.size() & 0xFFFF;
-  if (1 != fwrite(&numFrames, sizeof(numFrames), 1, indexFile)) qFatal("write fail at start");
-
-  for (uint16_t frame : frames)
-    if (1 != fwrite(&frame, sizeof(frame), 1, indexFile)) qFatal("write fail on frames");
-
-  for (uint64_t hash : hashes)
-    if (1 != fwrite(&hash, sizeof(hash), 1, indexFile)) qFatal("write fail on hashes");
-
-  fclose(indexFile);
-}
-
-void VideoIndex::load(const QString& file) {
-  FILE* indexFile = fopen(qPrintable(file), "rb");
-  if (!indexFile) qFatal("failed to open: %s", qPrintable(file));
-
+bool VideoIndex::load(const QString& file) {
   frames.clear();
   hashes.clear();
 
-  uint16_t numFrames = 0;
-  if (1 != fread(&numFrames, sizeof(numFrames), 1, indexFile))
-    qFatal("read fail at index start: %s", qPrintable(file));
-
-  frames.reserve(numFrames);
-  hashes.reserve(numFrames);
-
-  // spec says reserve() could give more than we wanted
-  Q_ASSERT(frames.capacity() == numFrames);
-  Q_ASSERT(hashes.capacity() == numFrames);
-
-  // todo: it seems this could be read with one operation
-  for (int i = 0; i < numFrames; i++) {
-    uint16_t frame;
-    if (1 != fread(&frame, sizeof(frame), 1, indexFile))
-      qFatal("read fail at frame index %d: %s", i, qPrintable(file));
-
-    frames.push_back(frame);
+  // uint16_t numFrames, uint16_t frames[numFrames], uint64_t hashes[numFrames]
+  QFile f(file);
+  if (!f.open(QFile::ReadOnly)) {
+    qWarning() << "open failed:" << file << f.errorString();
+    return false;
   }
+  const QByteArray data = f.readAll();
 
-  for (int i = 0; i < numFrames; i++) {
-    uint64_t hash;
-    if (1 != fread(&hash, sizeof(hash), 1, indexFile))
-      qFatal("read fail at hash index %d: %s", i, qPrintable(file));
-
-    hashes.push_back(hash);
+  uint16_t numFrames = 0;
+  if (size_t(data.size()) >= sizeof(numFrames))
+    memcpy(&numFrames, data.constData(), sizeof(numFrames));
+
+  const size_t frameBytes = numFrames * sizeof(uint16_t);
+  const size_t hashBytes = numFrames * sizeof(uint64_t);
+  if (size_t(data.size()) < sizeof(numFrames) + frameBytes + hashBytes) {
+    qWarning() << "truncated:" << data.size() << "frames:" << numFrames << file;
+    return false;
   }
 
-  fclose(indexFile);
+  const char* ptr = data.constData() + sizeof(numFrames);
+  std::vector<uint16_t> legacyFrames(numFrames);
+  memcpy(legacyFrames.data(), ptr, frameBytes);
+  frames.assign(legacyFrames.begin(), legacyFrames.end());
+
+  hashes.resize(numFrames);
+  memcpy(hashes.data(), ptr + frameBytes, hashBytes);
+  return true;
 }
 
 void Media::playSideBySide(const Media& left, float seekLeft, const Media& right, float seekRight) {
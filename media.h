@@ -57,19 +57,22 @@ typedef QHash<QString, QString> QStringHash;
  * Index is compressed by omitting nearby frames,
  * therefore there is also list of frame numbers;
  *
- * @note uint16_t limits video to < 2^16-1 frames indexed
- *
- * fixme: increase this by storing the offset from previous frame (maybe uint8)
+ * @note stored by VideoHashStore, the legacy per-video file
+ *       limited videos to < 2^16-1 frames indexed
  */
 class VideoIndex {
  public:
-  std::vector<uint16_t> frames;  // frame number
+  std::vector<uint32_t> frames;  // frame number
   VideoHashList hashes;          // dct hash
 
   size_t memSize() const { return sizeof(*this) + VECTOR_SIZE(frames) + VECTOR_SIZE(hashes); }
   bool isEmpty() const { return frames.size() == 0 || hashes.size() == 0; }
-  void save(const QString& file) const;
-  void load(const QString& file);
+
+  /**
+   * Read legacy file (.vdx) with 16-bit frame numbers
+   * @return false if it could not be read or is truncated
+   */
+  bool load(const QString& file);
 };
 
 /**
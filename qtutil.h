@@ -116,6 +116,13 @@ class DBHelper {
     return !cacheInfo.exists() || lastModified(db) > cacheInfo.lastModified();
   }
 
+  /// @param dbPath file of a local database, for when the connection is not at hand
+  static bool isCacheFileStale(const QString& dbPath, const QString& cacheFile) {
+    QFileInfo cacheInfo(cacheFile), dbInfo(dbPath);
+    return !cacheInfo.exists() || !dbInfo.exists() ||
+           dbInfo.lastModified() > cacheInfo.lastModified();
+  }
+
   static QDateTime lastModified(const QSqlDatabase& db);
 };
 
@@ -37,14 +37,38 @@ class DctTree {
  public:
   HammingTree _tree;
 
+  enum { Format = 6 };  // cache file tag, change if write() changes
+
+  void write(QFile& f) const { _tree.write(f); }
+  bool read(const char* data, size_t len) { return _tree.read(data, len); }
+  bool map(char* data, size_t len) { return _tree.map(data, len); }
+  void detach() { _tree.detach(); }
+
   void create(uint64_t* hashes, uint32_t* ids, int numHashes) {
+    std::vector<HammingTree::hash_t> treeHashes(hashes, hashes + numHashes);
+    std::vector<HammingTree::index_t> treeIds(ids, ids + numHashes);
+    _tree.build(treeHashes, treeIds);
+    HammingTree::Stats stats = _tree.stats();
+    qInfo() << "height" << stats.maxHeight;
+  }
+
+  void insert(uint64_t* hashes, uint32_t* ids, int numHashes) {
     std::vector<HammingTree::Value> values;
     for (int i = 0; i < numHashes; ++i) values.push_back(HammingTree::Value(ids[i], hashes[i]));
     _tree.insert(values);
-    HammingTree::Stats stats = _tree.stats();
-    qInfo() << "height" << stats.maxHeight;
   }
 
+  // one pass over the clusters for all the items
+  void remove(const uint64_t* hashes, const uint32_t* ids, int count) {
+    (void)hashes;
+    std::unordered_set<HammingTree::index_t> idSet(ids, ids + count);
+    _tree.remove(idSet);
+  }
+
+  void compact() { _tree.compact(); }
+
+  size_t memoryUsage() const { return _tree.stats().memory; }
+
   QVector<Index::Match> search(uint64_t target, int threshold) {
     QVector<Index::Match> matches;
     std::vector<HammingTree::Match> results;
@@ -52,6 +76,24 @@ class DctTree {
     for (auto& r : results) matches.append(Index::Match(r.value.index, r.distance));
     return matches;
   }
+
+  QVector<Index::Match> searchNearest(uint64_t target, int k, int minThresh, int maxThresh) {
+    QVector<Index::Match> matches;
+    std::vector<HammingTree::Match> results;
+    _tree.searchNearest(target, size_t(k), minThresh, maxThresh, results);
+    for (auto& r : results) matches.append(Index::Match(r.value.index, r.distance));
+    return matches;
+  }
+
+  QVector<QVector<Index::Match>> search(const std::vector<uint64_t>& targets, int threshold) {
+    std::vector<std::vector<HammingTree::Match>> results;
+    _tree.search(targets, threshold, results);
+
+    QVector<QVector<Index::Match>> matches(int(targets.size()));
+    for (size_t i = 0; i < results.size(); ++i)
+      for (auto& r : results[i]) matches[int(i)].append(Index::Match(r.value.index, r.distance));
+    return matches;
+  }
 };
 
 #endif
@@ -69,6 +111,18 @@ class DctPoint {
 
 class DctTree : public VPTree<DctPoint> {
  public:
+  enum { Format = 3 };  // cache file tag, change if write() changes
+
+  // not cached, tree is rebuilt from the hashes
+  void write(QFile& f) const { (void)f; }
+  bool read(const char* data, size_t len) {
+    (void)data;
+    (void)len;
+    return false;
+  }
+  bool map(char* data, size_t len) { return read(data, len); }
+  void detach() {}
+
   double distance(const DctPoint& p1, const DctPoint& p2) override {
     return hamm64(p1.hash, p2.hash);
   }
@@ -80,6 +134,20 @@ class DctTree : public VPTree<DctPoint> {
     this->addMany(points.begin(), points.end());
   }
 
+  void insert(uint64_t* hashes, uint32_t* ids, int numHashes) {
+    create(hashes, ids, numHashes);
+  }
+
+  // no removal in the library, filter search results instead
+  void remove(const uint64_t* hashes, const uint32_t* ids, int count) {
+    (void)hashes;
+    for (int i = 0; i < count; ++i) _removed.insert(ids[i]);
+  }
+
+  void compact() {}
+
+  size_t memoryUsage() const { return 0; }  // not known
+
   QVector<Index::Match> search(uint64_t target, int threshold) {
     QVector<Index::Match> matches;
 
@@ -88,10 +156,26 @@ class DctTree : public VPTree<DctPoint> {
     for (auto& p : points) {
       int d = hamm64(p->hash, target);
       Q_ASSERT(d < threshold);
-      matches.append(Index::Match(p->id, d));
+      if (!_removed.contains(p->id)) matches.append(Index::Match(p->id, d));
     }
     return matches;
   }
+
+  // caller trims to the nearest
+  QVector<Index::Match> searchNearest(uint64_t target, int k, int minThresh, int maxThresh) {
+    (void)k;
+    (void)minThresh;
+    return search(target, maxThresh);
+  }
+
+  QVector<QVector<Index::Match>> search(const std::vector<uint64_t>& targets, int threshold) {
+    QVector<QVector<Index::Match>> matches;
+    for (uint64_t target : targets) matches.append(search(target, threshold));
+    return matches;
+  }
+
+ private:
+  QSet<uint32_t> _removed;
 };
 #endif
 
@@ -108,19 +192,49 @@ class DctTree {
     vpValue(uint64_t h, uint32_t i) : hash(h), id(i) {}
     static vpValue min() { return vpValue(0, 0); }
     static vpValue max() { return vpValue(UINT64_MAX, 0); }
+    bool operator==(const vpValue& o) const { return hash == o.hash && id == o.id; }
+    bool isValid() const { return id != 0; }
+    void invalidate() { id = 0; }
   };
   static inline int vpDistance(vpValue v1, vpValue v2) { return hamm64(v1.hash, v2.hash); };
 
   VpTree<vpValue, int, vpDistance> _tree;
 
  public:
+  enum { Format = 5 };  // cache file tag, change if write() changes
+
+  void write(QFile& f) const { _tree.write(f); }
+  bool read(const char* data, size_t len) { return _tree.read(data, len); }
+  bool map(char* data, size_t len) { return _tree.map(data, len); }
+  void detach() { _tree.detach(); }
+
   void create(uint64_t* hashes, uint32_t* ids, int numHashes) {
     std::vector<vpValue> values;
-    for (int i = 0; i < numHashes; ++i) values.push_back(vpValue(hashes[i], ids[i]));
+    for (int i = 0; i < numHashes; ++i)
+      if (ids[i]) values.push_back(vpValue(hashes[i], ids[i]));
     _tree.create(values);
     //_tree.printStats();
   }
 
+  void insert(uint64_t* hashes, uint32_t* ids, int numHashes) {
+    std::vector<vpValue> values;
+    for (int i = 0; i < numHashes; ++i)
+      if (ids[i]) values.push_back(vpValue(hashes[i], ids[i]));
+    _tree.insert(values);
+  }
+
+  // each item is found by searching for its hash, no need to batch
+  void remove(const uint64_t* hashes, const uint32_t* ids, int count) {
+    for (int i = 0; i < count; ++i)
+      if (!_tree.remove(vpValue(hashes[i], ids[i]))) qWarning("id %u not found in tree", ids[i]);
+  }
+
+  void compact() {
+    if (_tree.removed()) _tree.rebuild();
+  }
+
+  size_t memoryUsage() const { return _tree.memoryUsage(); }
+
   QVector<Index::Match> search(uint64_t target, int threshold) {
     std::vector<int> distances;
     std::vector<vpValue> results;
@@ -135,5 +249,29 @@ class DctTree {
     }
     return matches;
   }
+
+  QVector<Index::Match> searchNearest(uint64_t target, int k, int minThresh, int maxThresh) {
+    std::vector<int> distances;
+    std::vector<vpValue> results;
+    _tree.searchNearest(vpValue{target, 0}, size_t(k), minThresh, maxThresh, &results, &distances);
+
+    QVector<Index::Match> matches;
+    for (size_t i = 0; i < distances.size(); ++i)
+      matches.append(Index::Match(results[i].id, distances[i]));
+    return matches;
+  }
+
+  QVector<QVector<Index::Match>> search(const std::vector<uint64_t>& targets, int threshold) {
+    std::vector<vpValue> values;
+    for (uint64_t target : targets) values.push_back(vpValue(target, 0));
+
+    std::vector<std::vector<std::pair<vpValue, int>>> results;
+    _tree.search(values, threshold, results);
+
+    QVector<QVector<Index::Match>> matches(int(targets.size()));
+    for (size_t i = 0; i < results.size(); ++i)
+      for (auto& r : results[i]) matches[int(i)].append(Index::Match(r.first.id, r.second));
+    return matches;
+  }
 };
 #endif
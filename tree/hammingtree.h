@@ -31,6 +31,7 @@
 #  include <malloc.h>
 #  define malloc_size(x) malloc_usable_size((void*)(x))
 #endif
+#include <queue>
 #include <unordered_set>
 
 /**
@@ -51,6 +52,17 @@
  *
  * The leaves of the tree are large chunks (CLUSTER_SIZE) which can be searched
  * very quickly and reduce the miss rate somewhat.
+ *
+ * To reduce misses further, a search can visit more than one leaf (multi-probe):
+ * after the exact path, the branches that disagree with the fewest bits of
+ * the hash are visited next, until the probe budget is used.
+ *
+ * For building a large tree from scratch, build() is much faster than insert(),
+ * and the clusters share one block of memory.
+ *
+ * The file format (write()) is a table of nodes followed by the clusters in
+ * two contiguous blocks (hashes, indices), so a file can be used in place with
+ * map() and its pages shared between processes.
  */
 class HammingTree {
  public:
@@ -84,20 +96,70 @@ class HammingTree {
     int numNodes;
     int maxHeight;
     int numValues;
-    Stats() : memory(sizeof(HammingTree)), numNodes(0), maxHeight(0), numValues(0) {}
+    int numRemoved;  // values removed but still in the clusters, see compact()
+    Stats()
+        : memory(sizeof(HammingTree)), numNodes(0), maxHeight(0), numValues(0), numRemoved(0) {}
   };
 
   HammingTree() { init(); }
   ~HammingTree() { clear(); }
 
-  /// Find hash with distance(hash, cand) < threshold
-  void search(hash_t hash, distance_t threshold, std::vector<Match>& matches) const {
+  /**
+   * Find hash with distance(hash, cand) < threshold
+   * @param probes number of leaves to visit, 1 is the exact path only
+   */
+  void search(hash_t hash, distance_t threshold, std::vector<Match>& matches,
+              int probes = 1) const {
     if (_root) {
-      search(_root, hash, threshold, matches);
+      if (probes > 1)
+        searchProbes(_root, hash, threshold, probes, matches);
+      else
+        search(_root, hash, threshold, matches);
       std::sort(matches.begin(), matches.end());
     }
   }
 
+  /**
+   * Find the k nearest hashes within maxThreshold
+   * @details The search path does not depend on the threshold, so the
+   *          cluster is scanned once and trimmed to the k-th nearest
+   * @return matches with distance < max(minThreshold, k-th nearest + 1)
+   */
+  void searchNearest(hash_t hash, size_t k, distance_t minThreshold, distance_t maxThreshold,
+                     std::vector<Match>& matches, int probes = 1) const {
+    search(hash, maxThreshold, matches, probes);  // sorted
+    if (k == 0 || matches.size() <= k) return;
+
+    const distance_t radius = std::max(minThreshold, matches[k - 1].distance + 1);
+    auto it = std::lower_bound(matches.begin(), matches.end(), Match(Value(0, 0), radius));
+    matches.erase(it, matches.end());
+  }
+
+  /**
+   * Search for many hashes in one traversal
+   * @details Hashes are grouped by the path they take, so each cluster
+   *          is scanned for all hashes that reach it while it is in cache
+   *          (multi-probe searches each hash separately)
+   * @param matches matches for each hash, sorted by distance
+   */
+  void search(const std::vector<hash_t>& hashes, distance_t threshold,
+              std::vector<std::vector<Match>>& matches, int probes = 1) const {
+    matches.clear();
+    matches.resize(hashes.size());
+    if (!_root) return;
+
+    if (probes > 1) {
+      for (size_t i = 0; i < hashes.size(); ++i) search(hashes[i], threshold, matches[i], probes);
+      return;
+    }
+
+    std::vector<uint32_t> active(hashes.size());
+    for (uint32_t i = 0; i < active.size(); ++i) active[i] = i;
+    search(_root, hashes, threshold, active.data(), active.size(), matches);
+
+    for (auto& m : matches) std::sort(m.begin(), m.end());
+  }
+
   /// Find Value with index
   void findIndex(index_t index, std::vector<hash_t>& results) const {
     if (_root) findIndex(_root, index, results);
@@ -112,9 +174,64 @@ class HammingTree {
     insert(_root, values, 0);
   }
 
-  /// Remove nodes
+  /**
+   * Replace contents with the given values, much faster than insert()
+   * @details Values are partitioned by the split bit of each level, ping-ponging
+   *          between the arrays and the cluster memory, and the subtrees are
+   *          built in parallel. The result is the same as insert() of all
+   *          values at once.
+   * @note hashes and indices are used for scratch, their contents are undefined after
+   */
+  void build(std::vector<hash_t>& hashes, std::vector<index_t>& indices) {
+    Q_ASSERT(hashes.size() == indices.size());
+    clear();
+
+    const size_t count = hashes.size();
+    _count = count;
+    _root = new Level;
+    if (count == 0) return;
+
+    _arenaHashes = strict_malloc(_arenaHashes, count);
+    _arenaIndices = strict_malloc(_arenaIndices, count);
+    _arenaSize = count;
+
+    // split serially until there are enough subtrees to keep the threads busy
+    const int numThreads = std::max(1, QThreadPool::globalInstance()->maxThreadCount());
+    const size_t numTasks = size_t(numThreads) * 4;
+    const size_t taskSize = std::max(count / numTasks, size_t(MIN_PARALLEL_SIZE));
+
+    const Span input{hashes.data(), indices.data()};
+    const Span arena{_arenaHashes, _arenaIndices};
+    std::vector<BuildTask> tasks;
+    build(_root, input, arena, 0, count, 0, taskSize, &tasks);
+
+    QtConcurrent::blockingMap(tasks, [this](const BuildTask& t) {
+      build(t.level, t.src, t.dst, t.begin, t.end, t.depth, 0, nullptr);
+    });
+  }
+
+  /**
+   * Remove nodes
+   * @details Values are marked removed (index 0) and skipped by write(), the
+   *          clusters are compacted once enough are removed
+   */
   void remove(std::unordered_set<index_t>& indexSet) {
-    if (_root) remove(_root, indexSet);
+    if (!_root) return;
+    _removed += remove(_root, indexSet);
+    if (_removed > _count / TOMBSTONE_RATIO) compact();
+  }
+
+  /// Rebuild the clusters without removed values
+  void compact() {
+    if (!_root || _removed == 0) return;
+
+    std::vector<hash_t> hashes;
+    std::vector<index_t> indices;
+    hashes.reserve(_count - _removed);
+    indices.reserve(_count - _removed);
+    values(_root, hashes, indices);
+
+    build(hashes, indices);
   }
 
   /// Copy a subtree; method to multithread searches
@@ -133,21 +250,69 @@ class HammingTree {
     Stats st;
 
     if (_root) stats(_root, st, 0);
+    st.numRemoved = int(_removed);
 
     return st;
   }
 
-  /// Read tree from file
-  void read(const char* file) {
-    FILE* fp = fopen(file, "rb");
-    Q_ASSERT(fp);
-    _root = read(fp);
-    fclose(fp);
+  /// Write tree to file, for loading with read() or map()
+  void write(QFile& f) const {
+    FileHeader header;
+    memcpy(header.magic, FileMagic, sizeof(header.magic));
+    header.version = FileVersion;
+    header.numValues = 0;
+
+    std::vector<FileNode> nodes;
+    std::vector<const Level*> leaves;
+    if (_root) flatten(_root, nodes, leaves, header.numValues);
+    header.numNodes = uint32_t(nodes.size());
+
+    const uint64_t nodesEnd = sizeof(header) + sizeof(FileNode) * nodes.size();
+    header.hashesOffset = alignOffset(nodesEnd);
+    header.indicesOffset = alignOffset(header.hashesOffset + sizeof(hash_t) * header.numValues);
+    header.length = header.indicesOffset + sizeof(index_t) * header.numValues;
+
+    QByteArray data;
+    data.append((const char*)&header, sizeof(header));
+    data.append((const char*)nodes.data(), qsizetype(sizeof(FileNode) * nodes.size()));
+    data.append(QByteArray(qsizetype(header.hashesOffset - nodesEnd), 0));
+    if (Q_UNLIKELY(data.length() != f.write(data))) throw f.errorString();
+
+    writeClusters(f, leaves, [](const Level* leaf) { return leaf->hashes; });
+
+    const QByteArray padding(
+        qsizetype(header.indicesOffset - header.hashesOffset - sizeof(hash_t) * header.numValues),
+        0);
+    if (Q_UNLIKELY(padding.length() != f.write(padding))) throw f.errorString();
+
+    writeClusters(f, leaves, [](const Level* leaf) { return leaf->indices; });
   }
 
-  /// Write tree to file
-  void write(QFile& f) {
-    if (_root) write(_root, f);
+  /**
+   * Replace tree with a copy of data written by write()
+   * @return false if the data is invalid or old version, tree is then empty
+   */
+  bool read(const char* data, size_t len) { return load(const_cast<char*>(data), len, false); }
+
+  /**
+   * Replace tree with data written by write(), clusters are not copied
+   * @details data must stay valid until the next build()/read() or detach(),
+   *          and be writable for remove(). If data is not aligned it is copied
+   * @return false if the data is invalid or old version, tree is then empty
+   */
+  bool map(char* data, size_t len) { return load(data, len, true); }
+
+  /// Copy mapped clusters so the data can be released
+  void detach() {
+    if (!_arenaMapped) return;
+    hash_t* hashes = strict_malloc(hashes, _arenaSize);
+    index_t* indices = strict_malloc(indices, _arenaSize);
+    memcpy(hashes, _arenaHashes, sizeof(hash_t) * _arenaSize);
+    memcpy(indices, _arenaIndices, sizeof(index_t) * _arenaSize);
+    if (_root) rebase(_root, hashes, indices);
+    _arenaHashes = hashes;
+    _arenaIndices = indices;
+    _arenaMapped = false;
   }
 
   /// Print the tree structure
@@ -162,6 +327,14 @@ class HammingTree {
   size_t size() const { return _count; }
 
  private:
+  enum {
+    // tuning: do not split a subtree across threads below this size
+    MIN_PARALLEL_SIZE = 256 * 1024,
+
+    // tuning: compact when removed values > 1/N of all values
+    TOMBSTONE_RATIO = 4
+  };
+
   struct Level {
     Level* left;
     Level* right;
@@ -169,15 +342,78 @@ class HammingTree {
     hash_t* hashes;
     size_t count;
     index_t* indices;
+    bool inArena;  // hashes/indices belong to the tree (build()), not malloc'd
 
-    Level() : left(nullptr), right(nullptr), bit(-1), hashes(nullptr), count(0), indices(nullptr){};
+    Level()
+        : left(nullptr),
+          right(nullptr),
+          bit(-1),
+          hashes(nullptr),
+          count(0),
+          indices(nullptr),
+          inArena(false){};
 
     ~Level() {
       delete left;
       delete right;
+      if (inArena) return;
       if (indices) free(indices);
       if (hashes) free(hashes);
     }
+
+    /// move cluster out of the arena so it can be realloc'd/freed
+    void detach() {
+      if (!inArena) return;
+      index_t* newIndices = strict_malloc(newIndices, count);
+      hash_t* newHashes = strict_malloc(newHashes, count);
+      memcpy(newIndices, indices, count * sizeof(*indices));
+      memcpy(newHashes, hashes, count * sizeof(*hashes));
+      indices = newIndices;
+      hashes = newHashes;
+      inArena = false;
+    }
+  };
+
+  /// Parallel arrays for build()
+  struct Span {
+    hash_t* hashes;
+    index_t* indices;
+  };
+
+  /// File header, offsets are from the start of the header
+  struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t numNodes;        // FileNode[numNodes] follows the header
+    uint64_t numValues;       // values in all clusters
+    uint64_t hashesOffset;    // hash_t[numValues], clusters in node order
+    uint64_t indicesOffset;   // index_t[numValues]
+    uint64_t length;          // total bytes
+  };
+
+  /// Node table entry, node 0 is the root
+  struct FileNode {
+    int32_t bit;     // split bit, -1 for leaf
+    uint32_t left;   // internal: node index of children
+    uint32_t right;
+    uint32_t unused;
+    uint64_t first;  // leaf: index of the cluster's first value
+    uint64_t count;  // leaf: number of values
+  };
+
+  static constexpr char FileMagic[8] = {'c', 'b', 'h', 'a', 'm', 't', 'r', 'e'};
+  enum { FileVersion = 1, FileAlignment = 64 };
+
+  static uint64_t alignOffset(uint64_t offset) {
+    return (offset + FileAlignment - 1) & ~uint64_t(FileAlignment - 1);
+  }
+
+  /// Subtree for build() to finish on another thread
+  struct BuildTask {
+    Level* level;
+    Span src, dst;
+    size_t begin, end;
+    int depth;
   };
 
   static void partition(int bit, const std::vector<Value>& values, std::vector<Value>& left,
@@ -191,6 +427,53 @@ class HammingTree {
 
   static int getBit(int depth) { return depth; }
 
+  // build level from src[begin,end), if tasks is given, stop at subtrees
+  // <= taskSize and append them to tasks instead
+  void build(Level* level, const Span& src, const Span& dst, size_t begin, size_t end, int depth,
+             size_t taskSize, std::vector<BuildTask>* tasks) {
+    Q_ASSERT(depth < 64);
+    const size_t count = end - begin;
+
+    if (tasks && count <= taskSize) {
+      tasks->push_back({level, src, dst, begin, end, depth});
+      return;
+    }
+
+    if (depth < 63 && count > (CLUSTER_SIZE / sizeof(hash_t))) {
+      // stable partition into dst, same order as partition()
+      const int bit = getBit(depth);
+      level->bit = bit;
+
+      size_t numLeft = 0;
+      for (size_t i = begin; i < end; ++i)
+        if (src.hashes[i] & (1 << bit)) numLeft++;
+
+      size_t l = begin, r = begin + numLeft;
+      for (size_t i = begin; i < end; ++i) {
+        const size_t j = (src.hashes[i] & (1 << bit)) ? l++ : r++;
+        dst.hashes[j] = src.hashes[i];
+        dst.indices[j] = src.indices[i];
+      }
+
+      level->left = new Level;
+      level->right = new Level;
+
+      const size_t mid = begin + numLeft;
+      build(level->left, dst, src, begin, mid, depth + 1, taskSize, tasks);
+      build(level->right, dst, src, mid, end, depth + 1, taskSize, tasks);
+    } else if (count > 0) {
+      // leaf, cluster memory is the same range of the arena
+      if (src.hashes != _arenaHashes) {
+        memcpy(_arenaHashes + begin, src.hashes + begin, count * sizeof(hash_t));
+        memcpy(_arenaIndices + begin, src.indices + begin, count * sizeof(index_t));
+      }
+      level->count = count;
+      level->hashes = _arenaHashes + begin;
+      level->indices = _arenaIndices + begin;
+      level->inArena = true;
+    }
+  }
+
   static void search(const Level* level, hash_t hash, distance_t threshold,
                      std::vector<Match>& matches) {
     if (level->left != nullptr) {
@@ -198,17 +481,82 @@ class HammingTree {
         search(level->left, hash, threshold, matches);
       else
         search(level->right, hash, threshold, matches);
-    } else {
-      const hash_t* hashes = level->hashes;
-      const index_t* indices = level->indices;
-      const size_t count = level->count;
+    } else
+      searchCluster(level, hash, threshold, matches);
+  }
+
+  static void searchCluster(const Level* level, hash_t hash, distance_t threshold,
+                            std::vector<Match>& matches) {
+    const hash_t* hashes = level->hashes;
+    const index_t* indices = level->indices;
+    const size_t count = level->count;
 
-      Q_ASSERT(malloc_size(hashes) >= count * sizeof(*hashes));
-      Q_ASSERT(malloc_size(indices) >= count * sizeof(*indices));
+    Q_ASSERT(level->inArena || malloc_size(hashes) >= count * sizeof(*hashes));
+    Q_ASSERT(level->inArena || malloc_size(indices) >= count * sizeof(*indices));
 
-      for (size_t i = 0; i < count; i++) {
-        distance_t distance = hamm64(hash, hashes[i]);
-        if (distance < threshold) matches.push_back(Match(Value(indices[i], hashes[i]), distance));
+    for (size_t i = 0; i < count; i++) {
+      distance_t distance = hamm64(hash, hashes[i]);
+      if (distance < threshold) matches.push_back(Match(Value(indices[i], hashes[i]), distance));
+    }
+  }
+
+  // best-first: the other branch of each level on the path is queued with
+  // the number of bits that disagree so far, ties go to the deeper branch
+  static void searchProbes(const Level* root, hash_t hash, distance_t threshold, int probes,
+                           std::vector<Match>& matches) {
+    struct Probe {
+      const Level* level;
+      int cost;
+      int depth;
+      bool operator<(const Probe& p) const {
+        return cost > p.cost || (cost == p.cost && depth < p.depth);
+      }
+    };
+
+    std::priority_queue<Probe> queue;
+    queue.push({root, 0, 0});
+
+    for (; probes > 0 && !queue.empty(); --probes) {
+      const Probe probe = queue.top();
+      queue.pop();
+
+      const Level* level = probe.level;
+      int depth = probe.depth;
+      while (level->left) {
+        const bool isLeft = (1 << level->bit) & hash;
+        queue.push({isLeft ? level->right : level->left, probe.cost + 1, depth + 1});
+        level = isLeft ? level->left : level->right;
+        depth++;
+      }
+      searchCluster(level, hash, threshold, matches);
+    }
+  }
+
+  // active[0,count) are indices of hashes that reach this level, it is
+  // partitioned in place for the children
+  static void search(const Level* level, const std::vector<hash_t>& hashes, distance_t threshold,
+                     uint32_t* active, size_t count, std::vector<std::vector<Match>>& matches) {
+    if (level->left != nullptr) {
+      const int bit = level->bit;
+      uint32_t* mid = std::partition(active, active + count,
+                                     [&](uint32_t i) { return (1 << bit) & hashes[i]; });
+      const size_t numLeft = size_t(mid - active);
+      if (numLeft > 0) search(level->left, hashes, threshold, active, numLeft, matches);
+      if (numLeft < count)
+        search(level->right, hashes, threshold, mid, count - numLeft, matches);
+    } else {
+      Q_ASSERT(level->inArena ||
+               malloc_size(level->hashes) >= level->count * sizeof(*level->hashes));
+      Q_ASSERT(level->inArena ||
+               malloc_size(level->indices) >= level->count * sizeof(*level->indices));
+
+      std::vector<HammMatch> found;
+      for (size_t j = 0; j < count; ++j) {
+        found.clear();
+        hamm64Scan(hashes[active[j]], level->hashes, level->count, threshold, found);
+        for (const HammMatch& f : found)
+          matches[active[j]].push_back(
+              Match(Value(level->indices[f.index], level->hashes[f.index]), f.distance));
       }
     }
   }
@@ -248,17 +596,36 @@ class HammingTree {
     }
   }
 
-  static void remove(Level* level, const std::unordered_set<index_t>& indexSet) {
+  // @return number of values removed
+  static size_t remove(Level* level, const std::unordered_set<index_t>& indexSet) {
+    if (level->left)
+      return remove(level->left, indexSet) + remove(level->right, indexSet);
+
+    index_t* indices = level->indices;
+    const size_t count = level->count;
+    const auto& end = indexSet.cend();
+    size_t removed = 0;
+
+    for (size_t i = 0; i < count; i++)
+      if (indices[i] && indexSet.find(indices[i]) != end) {
+        indices[i] = 0;
+        removed++;
+      }
+    return removed;
+  }
+
+  // append values that are not removed
+  static void values(const Level* level, std::vector<hash_t>& hashes,
+                     std::vector<index_t>& indices) {
     if (level->left) {
-      remove(level->left, indexSet);
-      remove(level->right, indexSet);
+      values(level->left, hashes, indices);
+      values(level->right, hashes, indices);
     } else {
-      index_t* indices = level->indices;
-      const size_t count = level->count;
-      const auto& end = indexSet.cend();
-
-      for (size_t i = 0; i < count; i++)
-        if (indexSet.find(indices[i]) != end) indices[i] = 0;
+      for (size_t i = 0; i < level->count; i++)
+        if (level->indices[i]) {
+          hashes.push_back(level->hashes[i]);
+          indices.push_back(level->indices[i]);
+        }
     }
   }
 
@@ -291,8 +658,11 @@ class HammingTree {
           right.push_back(value);
       }
 
-      free(level->indices);
-      free(level->hashes);
+      if (!level->inArena) {
+        free(level->indices);
+        free(level->hashes);
+      }
+      level->inArena = false;
       level->indices = nullptr;
       level->hashes = nullptr;
       level->count = 0;
@@ -304,6 +674,7 @@ class HammingTree {
       insert(level->right, right, depth + 1);
     } else {
       // leaf is not full, add some more
+      level->detach();
       size_t offset = level->count;
 
       level->count += values.size();
@@ -323,60 +694,130 @@ class HammingTree {
     }
   }
 
-  static Level* read(FILE* fp) {
-    Level* level = new Level;
-
-    bool isLeaf;
-    Q_ASSERT(fread(&isLeaf, sizeof(isLeaf), 1, fp) == 1);
-
-    if (feof(fp))
-      ;
-    else if (!isLeaf) {
-      Q_ASSERT(fread(&level->bit, sizeof(level->bit), 1, fp) == 1);
-
-      level->left = read(fp);
-      level->right = read(fp);
+  // append level and its children to the node table, depth-first
+  static void flatten(const Level* level, std::vector<FileNode>& nodes,
+                      std::vector<const Level*>& leaves, uint64_t& numValues) {
+    const size_t index = nodes.size();
+    nodes.push_back(FileNode{level->bit, 0, 0, 0, 0, 0});
+    if (level->left) {
+      nodes[index].left = uint32_t(nodes.size());
+      flatten(level->left, nodes, leaves, numValues);
+      nodes[index].right = uint32_t(nodes.size());
+      flatten(level->right, nodes, leaves, numValues);
     } else {
-      Q_ASSERT(fread(&level->count, sizeof(level->count), 1, fp) == 1);
-      if (level->count > 0) {
-        size_t size = sizeof(*level->indices) * level->count;
-        level->indices = (index_t*)malloc(size);
-        Q_ASSERT(fread(level->indices, size, 1, fp) == 1);
-
-        size = sizeof(*level->hashes) * level->count;
-        level->hashes = (hash_t*)malloc(size);
-        Q_ASSERT(fread(level->hashes, size, 1, fp) == 1);
-
-        Q_ASSERT(malloc_size(level->hashes) >= level->count * sizeof(*level->hashes));
-        Q_ASSERT(malloc_size(level->indices) >= level->count * sizeof(*level->indices));
+      // removed values (index 0) are not written
+      uint64_t count = 0;
+      for (size_t i = 0; i < level->count; i++)
+        if (level->indices[i]) count++;
+
+      nodes[index].bit = -1;
+      nodes[index].first = numValues;
+      nodes[index].count = count;
+      numValues += count;
+      leaves.push_back(level);
+    }
+  }
+
+  // write one array (hashes or indices) of each cluster, without removed values
+  template <typename Array>
+  static void writeClusters(QFile& f, const std::vector<const Level*>& leaves, Array array) {
+    typedef typename std::remove_pointer<decltype(array(nullptr))>::type T;
+    std::vector<T> live;
+    for (const Level* leaf : leaves) {
+      const T* data = array(leaf);
+      size_t count = leaf->count;
+      if (std::find(leaf->indices, leaf->indices + count, 0) != leaf->indices + count) {
+        live.clear();
+        for (size_t i = 0; i < count; i++)
+          if (leaf->indices[i]) live.push_back(data[i]);
+        data = live.data();
+        count = live.size();
       }
+      const qint64 len = qint64(sizeof(T) * count);
+      if (Q_UNLIKELY(len != f.write((const char*)data, len))) throw f.errorString();
     }
+  }
 
+  // make level from the node table, return nullptr if it is invalid
+  Level* unflatten(const FileNode* nodes, uint32_t numNodes, uint32_t index, uint64_t numValues,
+                   int depth) {
+    const FileNode& node = nodes[index];
+    Level* level = new Level;
+    level->bit = node.bit;
+
+    if (node.bit >= 0) {
+      if (depth >= 63 || node.left <= index || node.right <= index || node.left >= numNodes ||
+          node.right >= numNodes ||
+          !(level->left = unflatten(nodes, numNodes, node.left, numValues, depth + 1)) ||
+          !(level->right = unflatten(nodes, numNodes, node.right, numValues, depth + 1))) {
+        delete level;
+        return nullptr;
+      }
+    } else if (node.first > numValues || node.count > numValues - node.first) {
+      delete level;
+      return nullptr;
+    } else if (node.count > 0) {
+      level->count = node.count;
+      level->hashes = _arenaHashes + node.first;
+      level->indices = _arenaIndices + node.first;
+      level->inArena = true;
+    }
     return level;
   }
 
-  static void write(const Level* level, QFile& f) {
-    bool isLeaf = level->left == nullptr;
-    if (isLeaf) {
-      // todo: compact entries that have been "removed" (index == 0)
-      QByteArray data;
-      data.append((char*)&isLeaf, sizeof(isLeaf));
-      data.append((char*)&level->count, sizeof(level->count));
+  bool load(char* data, size_t len, bool mapped) {
+    clear();
+
+    FileHeader header;
+    if (len < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+
+    const uint64_t nodesEnd = sizeof(header) + sizeof(FileNode) * uint64_t(header.numNodes);
+    if (memcmp(header.magic, FileMagic, sizeof(header.magic)) != 0 ||
+        header.version != FileVersion || header.length != len || header.numValues > len ||
+        header.hashesOffset > len || header.indicesOffset > len || header.hashesOffset < nodesEnd ||
+        header.indicesOffset < header.hashesOffset + sizeof(hash_t) * header.numValues ||
+        header.length < header.indicesOffset + sizeof(index_t) * header.numValues)
+      return false;
+
+    char* hashes = data + header.hashesOffset;
+    char* indices = data + header.indicesOffset;
+    _arenaSize = header.numValues;
+
+    if (mapped && uintptr_t(hashes) % alignof(hash_t) == 0 &&
+        uintptr_t(indices) % alignof(index_t) == 0) {
+      _arenaHashes = reinterpret_cast<hash_t*>(hashes);
+      _arenaIndices = reinterpret_cast<index_t*>(indices);
+      _arenaMapped = true;
+    } else {
+      _arenaHashes = strict_malloc(_arenaHashes, _arenaSize);
+      _arenaIndices = strict_malloc(_arenaIndices, _arenaSize);
+      memcpy(_arenaHashes, hashes, sizeof(hash_t) * _arenaSize);
+      memcpy(_arenaIndices, indices, sizeof(index_t) * _arenaSize);
+    }
 
-      if (level->count > 0) {
-        data.append((char*)level->indices, sizeof(*level->indices) * level->count);
-        data.append((char*)level->hashes, sizeof(*level->hashes) * level->count);
-      }
+    if (header.numNodes == 0) return true;
 
-      if (Q_UNLIKELY(data.length() != f.write(data))) throw f.errorString();
-    } else {
-      QByteArray data;
-      data.append((char*)&isLeaf, sizeof(isLeaf));
-      data.append((char*)&level->bit, sizeof(level->bit));
-      if (Q_UNLIKELY(data.length() != f.write(data))) throw f.errorString();
+    std::vector<FileNode> nodes(header.numNodes);
+    memcpy((void*)nodes.data(), data + sizeof(header), sizeof(FileNode) * nodes.size());
 
-      write(level->left, f);
-      write(level->right, f);
+    _root = unflatten(nodes.data(), header.numNodes, 0, header.numValues, 0);
+    if (!_root) {
+      clear();
+      return false;
+    }
+    _count = header.numValues;
+    return true;
+  }
+
+  // point clusters that were in the old arena to the new one
+  void rebase(Level* level, hash_t* hashes, index_t* indices) {
+    if (level->left) {
+      rebase(level->left, hashes, indices);
+      rebase(level->right, hashes, indices);
+    } else if (level->inArena) {
+      level->hashes = hashes + (level->hashes - _arenaHashes);
+      level->indices = indices + (level->indices - _arenaIndices);
     }
   }
 
@@ -393,9 +834,16 @@ class HammingTree {
     }
   }
 
-  void init() { _root = nullptr, _count = 0; }
+  void init() {
+    _root = nullptr, _count = 0, _removed = 0;
+    _arenaHashes = nullptr, _arenaIndices = nullptr, _arenaSize = 0, _arenaMapped = false;
+  }
   void clear() {
     delete _root;
+    if (!_arenaMapped) {
+      free(_arenaHashes);
+      free(_arenaIndices);
+    }
     init();
   }
   bool empty() const { return _root == nullptr; }
@@ -415,5 +863,10 @@ class HammingTree {
   }
 
   Level* _root;
-  size_t _count;
+  size_t _count;    // values in the clusters
+  size_t _removed;  // values in the clusters with index 0
+  hash_t* _arenaHashes;  // cluster memory from build() or read()/map()
+  index_t* _arenaIndices;
+  size_t _arenaSize;
+  bool _arenaMapped;  // arena is the caller's data from map()
 };
@@ -0,0 +1,301 @@
+/* Multi-index hashing for DCT hashes
+   Copyright (C) 2021 scrubbbbs
+   Contact: screubbbebs@gemeaile.com =~ s/e//g
+   Project: https://github.com/scrubbbbs/cbird
+
+   This file is part of cbird.
+
+   cbird is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   cbird is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with cbird; if not, see
+   <https://www.gnu.org/licenses/>.  */
+#pragma once
+#include "../hamm.h"
+
+#include <algorithm>
+#include <vector>
+
+/**
+ * @class MultiIndexHash
+ * @brief Exact r-neighbor search for 64-bit hashes (Norouzi et al.)
+ *
+ * Each hash is split into NumTables disjoint 16-bit substrings, and each
+ * substring indexes a table of buckets. If two hashes are within distance r,
+ * at least one pair of substrings is within r/NumTables (pigeonhole), so
+ * probing every bucket within that radius in each table finds all of them.
+ *
+ * Unlike the trees this never misses, and the cost grows with the number
+ * of buckets probed rather than the fraction of the index visited.
+ *
+ * Inserts go to a pending list that is scanned linearly until the tables are
+ * rebuilt; removed items are tombstones (id 0) until compacted.
+ */
+class MultiIndexHash {
+ public:
+  typedef uint32_t index_t;
+  typedef uint64_t hash_t;
+  typedef int distance_t;
+
+  enum {
+    NumTables = 4,
+    KeyBits = 64 / NumTables,
+    NumBuckets = 1 << KeyBits,
+
+    // tuning: rebuild when pending items > 1/N of the tables
+    PendingRatio = 8,
+    MinPendingSize = 1024,
+
+    // tuning: compact when removed items > 1/N of all items
+    TombstoneRatio = 4
+  };
+
+  /// Search result, index is the id passed to create()/insert()
+  struct Match {
+    index_t index;
+    distance_t distance;
+  };
+
+  MultiIndexHash() { rebuild(); }
+
+  /// Replace contents, items with id 0 are skipped
+  void create(const hash_t* hashes, const index_t* ids, size_t count) {
+    _hashes.clear();
+    _ids.clear();
+    _removed = 0;
+    _hashes.reserve(count);
+    _ids.reserve(count);
+    append(hashes, ids, count);
+    rebuild();
+  }
+
+  /// Add more items, tables are rebuilt when enough are pending
+  void insert(const hash_t* hashes, const index_t* ids, size_t count) {
+    append(hashes, ids, count);
+    const size_t pending = _hashes.size() - _indexed;
+    if (pending > std::max(size_t(MinPendingSize), _indexed / PendingRatio)) rebuild();
+  }
+
+  /**
+   * Remove an item
+   * @return false if it was not found
+   */
+  bool remove(hash_t hash, index_t id) {
+    if (id == 0) return false;
+
+    size_t pos = _hashes.size();
+    for (size_t i = _indexed; i < _hashes.size(); ++i)
+      if (_ids[i] == id && _hashes[i] == hash) {
+        pos = i;
+        break;
+      }
+
+    if (pos == _hashes.size()) {
+      const uint key = subKey(hash, 0);
+      for (index_t i = _offsets[0][key]; i < _offsets[0][key + 1]; ++i) {
+        const index_t p = _items[0][i];
+        if (_ids[p] == id && _hashes[p] == hash) {
+          pos = p;
+          break;
+        }
+      }
+      if (pos == _hashes.size()) return false;
+    }
+
+    _ids[pos] = 0;
+    if (++_removed > _hashes.size() / TombstoneRatio) compact();
+    return true;
+  }
+
+  /// Find all items with hamm64(hash, item) < threshold
+  void search(hash_t hash, distance_t threshold, std::vector<Match>& matches) const {
+    if (threshold <= 0) return;
+
+    // radius for each substring, if any is further than this it was
+    // found in another table
+    const int radius = (threshold - 1) / NumTables;
+    const std::vector<uint16_t>& masks = probeMasks();
+    const uint numProbes = probeCount(radius);
+
+    uint needleKeys[NumTables];
+    for (int t = 0; t < NumTables; ++t) needleKeys[t] = subKey(hash, t);
+
+    for (int t = 0; t < NumTables; ++t) {
+      const uint32_t* offsets = _offsets[t].data();
+      const index_t* items = _items[t].data();
+
+      for (uint probe = 0; probe < numProbes; ++probe) {
+        const uint key = needleKeys[t] ^ masks[probe];
+        for (index_t i = offsets[key]; i < offsets[key + 1]; ++i) {
+          const index_t pos = items[i];
+          const index_t id = _ids[pos];
+          if (id == 0) continue;
+
+          const hash_t cand = _hashes[pos];
+          const distance_t d = hamm64(hash, cand);
+          if (d >= threshold) continue;
+
+          // only report from the first table that could find it
+          bool seen = false;
+          for (int j = 0; j < t && !seen; ++j)
+            seen = __builtin_popcount(needleKeys[j] ^ subKey(cand, j)) <= radius;
+          if (!seen) matches.push_back({id, d});
+        }
+      }
+    }
+
+    for (size_t i = _indexed; i < _hashes.size(); ++i) {
+      const distance_t d = hamm64(hash, _hashes[i]);
+      if (d < threshold && _ids[i]) matches.push_back({_ids[i], d});
+    }
+  }
+
+  /**
+   * Find all pairs of items with hamm64(a, b) < threshold (similarity join)
+   * @details For every table, items in the same bucket and buckets within
+   *          radius are compared, so each pair is computed once per table
+   *          that can find it and reported once (by the first table).
+   *          To run in parallel, split the key range [0,NumBuckets).
+   *          Pending items are not joined, use after create()
+   * @param emit callback emit(idA, idB, distance)
+   */
+  template <typename Emit>
+  void join(distance_t threshold, uint keyBegin, uint keyEnd, Emit&& emit) const {
+    if (threshold <= 0) return;
+
+    const int radius = (threshold - 1) / NumTables;
+    const std::vector<uint16_t>& masks = probeMasks();
+    const uint numProbes = probeCount(radius);
+
+    auto found = [&](index_t a, index_t b, int table) {
+      const index_t idA = _ids[a], idB = _ids[b];
+      if (idA == 0 || idB == 0) return;
+
+      const distance_t d = hamm64(_hashes[a], _hashes[b]);
+      if (d >= threshold) return;
+
+      // only report from the first table that could find it
+      for (int j = 0; j < table; ++j)
+        if (__builtin_popcount(subKey(_hashes[a], j) ^ subKey(_hashes[b], j)) <= radius) return;
+      emit(idA, idB, d);
+    };
+
+    for (int t = 0; t < NumTables; ++t) {
+      const uint32_t* offsets = _offsets[t].data();
+      const index_t* items = _items[t].data();
+
+      for (uint key = keyBegin; key < keyEnd; ++key) {
+        const index_t begin = offsets[key], end = offsets[key + 1];
+        if (begin == end) continue;
+
+        // pairs within the bucket
+        for (index_t i = begin; i < end; ++i)
+          for (index_t j = i + 1; j < end; ++j) found(items[i], items[j], t);
+
+        // pairs with buckets within radius, each bucket pair once (key < other)
+        for (uint probe = 1; probe < numProbes; ++probe) {
+          const uint other = key ^ masks[probe];
+          if (other < key) continue;
+          for (index_t i = begin; i < end; ++i)
+            for (index_t j = offsets[other]; j < offsets[other + 1]; ++j)
+              found(items[i], items[j], t);
+        }
+      }
+    }
+  }
+
+  /// Remove tombstones and index pending items
+  void compact() {
+    size_t j = 0;
+    for (size_t i = 0; i < _hashes.size(); ++i)
+      if (_ids[i]) {
+        _hashes[j] = _hashes[i];
+        _ids[j] = _ids[i];
+        j++;
+      }
+    _hashes.resize(j);
+    _ids.resize(j);
+    _hashes.shrink_to_fit();
+    _ids.shrink_to_fit();
+    _removed = 0;
+    rebuild();
+  }
+
+  /// @return number of valid items
+  size_t size() const { return _hashes.size() - _removed; }
+
+  size_t memoryUsage() const {
+    size_t bytes = sizeof(*this) + _hashes.capacity() * sizeof(hash_t) +
+                   _ids.capacity() * sizeof(index_t);
+    for (int t = 0; t < NumTables; ++t)
+      bytes += _offsets[t].capacity() * sizeof(uint32_t) + _items[t].capacity() * sizeof(index_t);
+    return bytes;
+  }
+
+ private:
+  std::vector<hash_t> _hashes;  // all items, [_indexed, size) are pending
+  std::vector<index_t> _ids;    // id for each hash, 0 if removed
+  std::vector<uint32_t> _offsets[NumTables];  // bucket start in _items, NumBuckets+1
+  std::vector<index_t> _items[NumTables];     // positions in _hashes sorted by substring
+  size_t _indexed = 0;
+  size_t _removed = 0;
+
+  static uint subKey(hash_t hash, int table) {
+    return uint(hash >> (table * KeyBits)) & (NumBuckets - 1);
+  }
+
+  /// all keys sorted by number of bits set
+  static const std::vector<uint16_t>& probeMasks() {
+    static const std::vector<uint16_t> masks = [] {
+      std::vector<uint16_t> m(NumBuckets);
+      for (uint i = 0; i < NumBuckets; ++i) m[i] = uint16_t(i);
+      std::stable_sort(m.begin(), m.end(), [](uint16_t a, uint16_t b) {
+        return __builtin_popcount(a) < __builtin_popcount(b);
+      });
+      return m;
+    }();
+    return masks;
+  }
+
+  /// @return number of masks with popcount <= radius
+  static uint probeCount(int radius) {
+    uint count = 0, binomial = 1;  // C(KeyBits, r)
+    for (int r = 0; r <= std::min(radius, int(KeyBits)); ++r) {
+      count += binomial;
+      binomial = binomial * uint(KeyBits - r) / uint(r + 1);
+    }
+    return count;
+  }
+
+  void append(const hash_t* hashes, const index_t* ids, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+      if (ids[i]) {
+        _hashes.push_back(hashes[i]);
+        _ids.push_back(ids[i]);
+      }
+  }
+
+  // counting sort of positions by substring
+  void rebuild() {
+    const size_t count = _hashes.size();
+    for (int t = 0; t < NumTables; ++t) {
+      std::vector<uint32_t>& offsets = _offsets[t];
+      offsets.assign(NumBuckets + 1, 0);
+      for (size_t i = 0; i < count; ++i) offsets[subKey(_hashes[i], t) + 1]++;
+      for (int k = 0; k < NumBuckets; ++k) offsets[k + 1] += offsets[k];
+
+      std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+      _items[t].resize(count);
+      for (size_t i = 0; i < count; ++i) _items[t][next[subKey(_hashes[i], t)]++] = index_t(i);
+    }
+    _indexed = count;
+  }
+};
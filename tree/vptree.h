@@ -24,12 +24,22 @@
 #include <algorithm>
 #include <vector>
 #include <stdio.h>
+#include <string.h>
 #include <queue>
 #include <limits>
+#include <type_traits>
 
 /**
  * @class VpTree
  * @brief Vantage-Point Tree tuned for 64-bit dct hashes
+ *
+ * ValueType must provide operator==, isValid() and invalidate(); removed
+ * items stay in the tree (invalid) until the next rebuild
+ *
+ * After construction the tree is compiled to two flat arrays: nodes in
+ * depth-first order (siblings are adjacent, so one 32-bit child offset),
+ * and leaf values packed together. The arrays contain no pointers,
+ * so write() saves them as-is and map() can use them in place.
  */
 template <typename ValueType, typename DistanceType,
           DistanceType (*distance)(ValueType, ValueType)>
@@ -40,11 +50,64 @@ class VpTree {
     //       int(sizeof(Node)), int(sizeof(ValueType)), int(sizeof(DistanceType)));
   }
 
-  ~VpTree() { delete _root; }
-
   void create(std::vector<ValueType>& items) {
-    delete _root;
-    _root = buildFromPoints(items, 0, items.size(), nullptr);
+    BuildNode* root =
+        items.empty() ? nullptr : buildFromPoints(items, 0, int(items.size()), nullptr);
+    compile(root);
+    delete root;
+    _size = items.size();
+    _removed = 0;
+    _pending.clear();
+  }
+
+  /**
+   * Add items without rebuilding the tree
+   * @details New items are kept in a pending list that is searched linearly,
+   *          once it grows past a fraction of the tree everything is rebuilt.
+   *          This makes insertion amortized O(log n) instead of O(n log n)
+   */
+  void insert(const std::vector<ValueType>& items) {
+    _pending.insert(_pending.end(), items.begin(), items.end());
+    if (_pending.size() > std::max(size_t(MinPendingSize), _size / PendingRatio)) rebuild();
+  }
+
+  /**
+   * Remove an item (operator==), the tree is not modified
+   * @details The item is invalidated (tombstone) so it is no longer returned
+   *          by search(), the tree is compacted once enough are removed
+   * @return false if the item was not found
+   */
+  bool remove(const ValueType& item) {
+    auto it = std::find(_pending.begin(), _pending.end(), item);
+    if (it != _pending.end()) {
+      _pending.erase(it);
+      return true;
+    }
+
+    if (!_numNodes || !invalidate(0, item)) return false;
+
+    if (++_removed > _size / TombstoneRatio) rebuild();
+    return true;
+  }
+
+  /// Rebuild the tree with pending items and without removed items
+  void rebuild() {
+    std::vector<ValueType> items;
+    items.reserve(_size - _removed + _pending.size());
+    if (_numNodes) collect(0, items);
+    items.insert(items.end(), _pending.begin(), _pending.end());
+    create(items);
+  }
+
+  /// @return number of valid items, including pending
+  size_t size() const { return _size - _removed + _pending.size(); }
+
+  /// @return number of removed items still in the tree, until rebuild()
+  size_t removed() const { return _removed; }
+
+  /// @return bytes used by the compiled tree
+  size_t memoryUsage() const {
+    return sizeof(Node) * _numNodes + sizeof(ValueType) * (_numValues + _pending.size());
   }
 
   void search(const ValueType target, const DistanceType threshold,
@@ -52,7 +115,12 @@ class VpTree {
               std::vector<DistanceType>* distances) {
 
     std::priority_queue<HeapItem> heap;
-    thresholdSearch(_root, target, threshold, heap);
+    if (_numNodes) thresholdSearch(0, target, threshold, heap);
+
+    for (const ValueType& value : _pending) {
+      const DistanceType dist = distance(value, target);
+      if (dist < threshold) heap.push(HeapItem(dist, value));
+    }
 
     results->clear();
     distances->clear();
@@ -68,28 +136,162 @@ class VpTree {
     std::reverse(distances->begin(), distances->end());
   }
 
+  /**
+   * Search for the k nearest items
+   * @details The search radius starts at maxThreshold and shrinks to the
+   *          distance of the k-th nearest item found so far, but never
+   *          below minThreshold
+   * @return items with distance < the final radius, which are the k nearest,
+   *         ties with the k-th nearest, and everything within minThreshold
+   */
+  void searchNearest(const ValueType target, size_t k, const DistanceType minThreshold,
+                     const DistanceType maxThreshold, std::vector<ValueType>* results,
+                     std::vector<DistanceType>* distances) const {
+    Nearest nearest(k, minThreshold, maxThreshold);
+
+    for (const ValueType& value : _pending) nearest.add(value, distance(value, target));
+
+    if (_numNodes) nearestSearch(0, target, nearest);
+
+    const DistanceType radius = nearest.radius();
+    std::vector<HeapItem>& items = nearest.candidates;
+    std::sort(items.begin(), items.end());
+
+    results->clear();
+    distances->clear();
+    for (const HeapItem& item : items)
+      if (item.dist < radius) {
+        results->push_back(item.value);
+        distances->push_back(item.dist);
+      }
+  }
+
+  /**
+   * Search for many targets in one traversal
+   * @details Each node is visited once for all targets that reach it, and
+   *          leaves are compared to every target while they are in cache
+   * @param matches matches for each target, sorted by distance
+   */
+  void search(const std::vector<ValueType>& targets, const DistanceType threshold,
+              std::vector<std::vector<std::pair<ValueType, DistanceType>>>& matches) const {
+    matches.clear();
+    matches.resize(targets.size());
+
+    if (_numNodes) {
+      std::vector<uint32_t> active(targets.size());
+      for (uint32_t i = 0; i < active.size(); ++i) active[i] = i;
+      batchSearch(0, targets, threshold, active, 0, active.size(), matches);
+    }
+
+    for (const ValueType& value : _pending)
+      for (size_t i = 0; i < targets.size(); ++i) {
+        const DistanceType dist = distance(value, targets[i]);
+        if (dist < threshold) matches[i].push_back({value, dist});
+      }
+
+    for (auto& m : matches)
+      std::sort(m.begin(), m.end(),
+                [](const std::pair<ValueType, DistanceType>& a,
+                   const std::pair<ValueType, DistanceType>& b) { return a.second < b.second; });
+  }
+
+  /// Write tree to file, for loading with read() or map()
+  void write(QFile& f) const {
+    static_assert(std::is_trivially_copyable<ValueType>::value, "ValueType must be POD");
+
+    FileHeader header;
+    header.numNodes = _numNodes;
+    header.numValues = _numValues;
+    header.numPending = uint32_t(_pending.size());
+    header.unused = 0;
+
+    QByteArray data;
+    data.append((const char*)&header, sizeof(header));
+    data.append((const char*)_nodes, qsizetype(sizeof(Node) * _numNodes));
+    data.append((const char*)_values, qsizetype(sizeof(ValueType) * _numValues));
+    data.append((const char*)_pending.data(), qsizetype(sizeof(ValueType) * _pending.size()));
+    if (Q_UNLIKELY(data.length() != f.write(data))) throw f.errorString();
+  }
+
+  /**
+   * Replace tree with a copy of data written by write()
+   * @return false if the data is invalid, tree is then empty
+   */
+  bool read(const char* data, size_t len) { return load(const_cast<char*>(data), len, false); }
+
+  /**
+   * Replace tree with data written by write(), without copying
+   * @details data must stay valid until the next create()/read() or detach(),
+   *          and be writable for remove(). If data is not aligned it is copied
+   * @return false if the data is invalid, tree is then empty
+   */
+  bool map(char* data, size_t len) { return load(data, len, true); }
+
+  /// Copy mapped data so it can be released
+  void detach() {
+    if (_nodes == _nodeStore.data() && _values == _valueStore.data()) return;
+    _nodeStore.assign(_nodes, _nodes + _numNodes);
+    _valueStore.assign(_values, _values + _numValues);
+    _nodes = _nodeStore.data();
+    _values = _valueStore.data();
+  }
+
   void printStats() const {
-    int maxDepth = depth(_root);
-    int numNodes = count(_root);
-    qInfo("hashes=%d depth=%d 2^d=%d", numNodes, maxDepth, 1 << maxDepth);
+    int maxDepth = _numNodes ? depth(0) : 0;
+    qInfo("hashes=%d nodes=%u depth=%d 2^d=%d", int(_size), _numNodes, maxDepth, 1 << maxDepth);
   }
 
  private:
-  struct Node {
+  // temporary tree for construction
+  struct BuildNode {
     ValueType value;
     DistanceType threshold = 0;
-    Node* left = nullptr;
-    Node* right = nullptr;
+    BuildNode* left = nullptr;
+    BuildNode* right = nullptr;
     std::vector<ValueType> leaf;
-    ~Node() {
+    ~BuildNode() {
       delete left;
       delete right;
     }
-  } *_root = nullptr;
+  };
+
+  // compiled tree node
+  struct Node {
+    ValueType value;         // vantage point, unused for leaf
+    DistanceType threshold;  // partition distance, unused for leaf
+    uint32_t first;          // internal: index of left child, right is first+1
+                             // leaf: index of first value in _values
+    uint32_t count;          // leaf: number of values, 0 for internal node
+  };
+
+  struct FileHeader {
+    uint32_t numNodes;
+    uint32_t numValues;
+    uint32_t numPending;
+    uint32_t unused;
+  };
+
+  std::vector<Node> _nodeStore;        // compiled nodes, if not mapped
+  std::vector<ValueType> _valueStore;  // compiled leaf values, if not mapped
+  Node* _nodes = nullptr;              // _nodeStore or mapped data
+  ValueType* _values = nullptr;        // _valueStore or mapped data
+  uint32_t _numNodes = 0;
+  uint32_t _numValues = 0;
+
+  size_t _size = 0;                 // number of items in the tree, including removed
+  size_t _removed = 0;              // number of invalidated items in the tree
+  std::vector<ValueType> _pending;  // inserted items not in the tree yet
 
   enum {
     // tuning: minimum 3, maximum number of elements in a leaf node
-    MaxLeafSize = 10
+    MaxLeafSize = 10,
+
+    // tuning: rebuild when pending items > 1/N of the tree
+    PendingRatio = 8,
+    MinPendingSize = 1024,
+
+    // tuning: rebuild when removed items > 1/N of the tree
+    TombstoneRatio = 4
   };
 
   struct HeapItem {
@@ -115,8 +317,8 @@ class VpTree {
     }
   };
 
-  Node* buildFromPoints(std::vector<ValueType>& items,
-                        int lower, const int upper, Node* parent) {
+  BuildNode* buildFromPoints(std::vector<ValueType>& items,
+                        int lower, const int upper, BuildNode* parent) {
 
     Q_ASSERT(lower >= 0 && lower < int(items.size()));
     Q_ASSERT(upper > 0 && upper <= int(items.size()));
@@ -124,7 +326,7 @@ class VpTree {
 
     //if (upper == lower) return nullptr;
 
-    Node* node = new Node();
+    BuildNode* node = new BuildNode();
     //node->value = items[lower];
 
     if (upper - lower > MaxLeafSize) {
@@ -225,49 +427,276 @@ class VpTree {
     return node;
   }
 
-  void thresholdSearch(const Node* node, const ValueType& target, const DistanceType threshold,
-                       std::priority_queue<HeapItem>& matches) const {
+  // flatten depth-first so each subtree is contiguous, with siblings adjacent
+  void compile(const BuildNode* root) {
+    _nodeStore.clear();
+    _valueStore.clear();
+
+    if (root) {
+      _nodeStore.push_back(Node());
+      compile(root, 0);
+    }
+
+    _nodes = _nodeStore.data();
+    _values = _valueStore.data();
+    _numNodes = uint32_t(_nodeStore.size());
+    _numValues = uint32_t(_valueStore.size());
+  }
 
-    const std::vector<ValueType>& leaf = node->leaf;
+  void compile(const BuildNode* b, uint32_t index) {
+    Node node = Node();
+    node.value = b->value;
+    node.threshold = b->threshold;
+    if (b->leaf.size()) {
+      node.first = uint32_t(_valueStore.size());
+      node.count = uint32_t(b->leaf.size());
+      _valueStore.insert(_valueStore.end(), b->leaf.begin(), b->leaf.end());
+      _nodeStore[index] = node;
+      return;
+    }
+
+    node.first = uint32_t(_nodeStore.size());
+    node.count = 0;
+    _nodeStore[index] = node;
+    _nodeStore.push_back(Node());
+    _nodeStore.push_back(Node());
+    compile(b->left, node.first);
+    compile(b->right, node.first + 1);
+  }
 
-    if (leaf.size()) {
-      Q_ASSERT(node->left == nullptr && node->right == nullptr);
-      const std::vector<ValueType>& leaf = node->leaf;
-      for (auto it = leaf.begin(); it != leaf.end(); ++it) {
-        const ValueType& value = *it;
+  bool load(char* data, size_t len, bool mapped) {
+    _nodeStore.clear();
+    _valueStore.clear();
+    _nodes = nullptr;
+    _values = nullptr;
+    _numNodes = _numValues = 0;
+    _size = _removed = 0;
+    _pending.clear();
+
+    FileHeader header;
+    if (len < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+
+    const size_t nodesLen = sizeof(Node) * header.numNodes;
+    const size_t valuesLen = sizeof(ValueType) * header.numValues;
+    const size_t pendingLen = sizeof(ValueType) * header.numPending;
+    if (len != sizeof(header) + nodesLen + valuesLen + pendingLen) return false;
+
+    char* nodes = data + sizeof(header);
+    char* values = nodes + nodesLen;
+    char* pending = values + valuesLen;
+
+    if (mapped && uintptr_t(nodes) % alignof(Node) == 0 &&
+        uintptr_t(values) % alignof(ValueType) == 0) {
+      _nodes = reinterpret_cast<Node*>(nodes);
+      _values = reinterpret_cast<ValueType*>(values);
+    } else {
+      _nodeStore.resize(header.numNodes);
+      _valueStore.resize(header.numValues);
+      memcpy((void*)_nodeStore.data(), nodes, nodesLen);
+      memcpy((void*)_valueStore.data(), values, valuesLen);
+      _nodes = _nodeStore.data();
+      _values = _valueStore.data();
+    }
+    _numNodes = header.numNodes;
+    _numValues = header.numValues;
+
+    _pending.resize(header.numPending);
+    memcpy((void*)_pending.data(), pending, pendingLen);
+
+    // check offsets so search can trust them
+    for (uint32_t i = 0; i < _numNodes; ++i) {
+      const Node& node = _nodes[i];
+      const bool ok = node.count ? uint64_t(node.first) + node.count <= _numValues
+                                 : node.first > i && uint64_t(node.first) + 1 < _numNodes;
+      if (!ok) {
+        load(nullptr, 0, false);
+        return false;
+      }
+    }
+
+    if (_numNodes) countItems(0, _size, _removed);
+    return true;
+  }
+
+  void thresholdSearch(uint32_t index, const ValueType& target, const DistanceType threshold,
+                       std::priority_queue<HeapItem>& matches) const {
+    const Node& node = _nodes[index];
+
+    if (node.count) {
+      const ValueType* leaf = _values + node.first;
+      for (uint32_t i = 0; i < node.count; ++i) {
+        const ValueType& value = leaf[i];
         const DistanceType dist = distance(value, target);
-        if (dist < threshold)
+        if (dist < threshold && value.isValid())
           matches.push(HeapItem(dist, value));
       }
       return;
     }
 
-    const DistanceType t = node->threshold;
-    const DistanceType d = distance(node->value, target);
+    const DistanceType t = node.threshold;
+    const DistanceType d = distance(node.value, target);
 
-    if (d < threshold)
-      matches.push(HeapItem(d, node->value));
+    if (d < threshold && node.value.isValid())
+      matches.push(HeapItem(d, node.value));
 
     if ( d - threshold < t )
-      thresholdSearch(node->left, target, threshold, matches);
+      thresholdSearch(node.first, target, threshold, matches);
     if ( d + threshold >= t )
-      thresholdSearch(node->right, target, threshold, matches);
+      thresholdSearch(node.first + 1, target, threshold, matches);
   }
 
-  static int depth(Node* node) {
-    int left = 0;
-    int right = 0;
-    if (node->left) left = 1 + depth(node->left);
-    if (node->right) right = 1 + depth(node->right);
-    return std::max(left, right);
+  // state of the nearest search
+  struct Nearest {
+    size_t k;
+    DistanceType minThreshold, maxThreshold;
+    std::priority_queue<DistanceType> best;  // k smallest distances, largest on top
+    std::vector<HeapItem> candidates;        // everything within radius when found
+
+    Nearest(size_t k_, DistanceType min_, DistanceType max_)
+        : k(k_), minThreshold(min_), maxThreshold(max_) {}
+
+    DistanceType radius() const {
+      if (k == 0 || best.size() < k) return maxThreshold;
+      return std::max(minThreshold, std::min(maxThreshold, DistanceType(best.top() + 1)));
+    }
+
+    void add(const ValueType& value, DistanceType dist) {
+      if (dist >= radius()) return;
+      candidates.push_back(HeapItem(dist, value));
+      if (best.size() < k)
+        best.push(dist);
+      else if (k > 0 && dist < best.top()) {
+        best.pop();
+        best.push(dist);
+      }
+    }
+  };
+
+  void nearestSearch(uint32_t index, const ValueType& target, Nearest& nearest) const {
+    const Node& node = _nodes[index];
+
+    if (node.count) {
+      const ValueType* leaf = _values + node.first;
+      for (uint32_t i = 0; i < node.count; ++i)
+        if (leaf[i].isValid()) nearest.add(leaf[i], distance(leaf[i], target));
+      return;
+    }
+
+    const DistanceType t = node.threshold;
+    const DistanceType d = distance(node.value, target);
+
+    if (node.value.isValid()) nearest.add(node.value, d);
+
+    // visit the side the target is on first so the radius shrinks sooner
+    if (d < t) {
+      if (d - nearest.radius() < t) nearestSearch(node.first, target, nearest);
+      if (d + nearest.radius() >= t) nearestSearch(node.first + 1, target, nearest);
+    } else {
+      if (d + nearest.radius() >= t) nearestSearch(node.first + 1, target, nearest);
+      if (d - nearest.radius() < t) nearestSearch(node.first, target, nearest);
+    }
+  }
+
+  // active[begin,end) are the targets that reach this node, child lists
+  // are appended to active and removed when done
+  void batchSearch(uint32_t index, const std::vector<ValueType>& targets,
+                   const DistanceType threshold, std::vector<uint32_t>& active, size_t begin,
+                   size_t end,
+                   std::vector<std::vector<std::pair<ValueType, DistanceType>>>& matches) const {
+    const Node& node = _nodes[index];
+
+    if (node.count) {
+      const ValueType* leaf = _values + node.first;
+      for (uint32_t i = 0; i < node.count; ++i) {
+        const ValueType& value = leaf[i];
+        if (!value.isValid()) continue;
+        for (size_t j = begin; j < end; ++j) {
+          const DistanceType dist = distance(value, targets[active[j]]);
+          if (dist < threshold) matches[active[j]].push_back({value, dist});
+        }
+      }
+      return;
+    }
+
+    const DistanceType t = node.threshold;
+    const size_t leftBegin = active.size();
+    for (size_t j = begin; j < end; ++j) {
+      const uint32_t target = active[j];
+      const DistanceType d = distance(node.value, targets[target]);
+      if (d < threshold && node.value.isValid()) matches[target].push_back({node.value, d});
+      if (d - threshold < t) active.push_back(target);
+    }
+    const size_t rightBegin = active.size();
+    for (size_t j = begin; j < end; ++j) {
+      const uint32_t target = active[j];
+      const DistanceType d = distance(node.value, targets[target]);
+      if (d + threshold >= t) active.push_back(target);
+    }
+    const size_t rightEnd = active.size();
+
+    if (leftBegin < rightBegin)
+      batchSearch(node.first, targets, threshold, active, leftBegin, rightBegin, matches);
+    if (rightBegin < rightEnd)
+      batchSearch(node.first + 1, targets, threshold, active, rightBegin, rightEnd, matches);
+
+    active.resize(leftBegin);
+  }
+
+  // find the item and invalidate it; vantage points keep their distance
+  // so the tree remains searchable
+  bool invalidate(uint32_t index, const ValueType& item) {
+    Node& node = _nodes[index];
+    if (node.count) {
+      ValueType* leaf = _values + node.first;
+      for (uint32_t i = 0; i < node.count; ++i)
+        if (leaf[i].isValid() && leaf[i] == item) {
+          leaf[i].invalidate();
+          return true;
+        }
+      return false;
+    }
+
+    const DistanceType d = distance(node.value, item);
+    if (d == 0 && node.value.isValid() && node.value == item) {
+      node.value.invalidate();
+      return true;
+    }
+
+    // same as thresholdSearch() with threshold 1
+    if (d - 1 < node.threshold && invalidate(node.first, item)) return true;
+    if (d + 1 >= node.threshold && invalidate(node.first + 1, item)) return true;
+    return false;
+  }
+
+  void collect(uint32_t index, std::vector<ValueType>& items) const {
+    const Node& node = _nodes[index];
+    if (node.count) {
+      for (uint32_t i = 0; i < node.count; ++i)
+        if (_values[node.first + i].isValid()) items.push_back(_values[node.first + i]);
+      return;
+    }
+    if (node.value.isValid()) items.push_back(node.value);
+    collect(node.first, items);
+    collect(node.first + 1, items);
+  }
+
+  void countItems(uint32_t index, size_t& total, size_t& removed) const {
+    const Node& node = _nodes[index];
+    if (node.count) {
+      for (uint32_t i = 0; i < node.count; ++i) removed += !_values[node.first + i].isValid();
+      total += node.count;
+      return;
+    }
+    removed += !node.value.isValid();
+    total++;
+    countItems(node.first, total, removed);
+    countItems(node.first + 1, total, removed);
   }
 
-  static int count(Node* node) {
-    int val = 0;
-    if (node->leaf.size()) val += int(node->leaf.size());
-    else val += 1;
-    if (node->left) val += count(node->left);
-    if (node->right) val += count(node->right);
-    return val;
+  int depth(uint32_t index) const {
+    const Node& node = _nodes[index];
+    if (node.count) return 0;
+    return 1 + std::max(depth(node.first), depth(node.first + 1));
   }
 };
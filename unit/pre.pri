@@ -30,7 +30,7 @@ QT += widgets
 LIBS_PHASH = -lpHash -lpng -ljpeg
 
 # deps for core 
-FILES_INDEX = index ioutil media videocontext cvutil qtutil database scanner templatematcher params
+FILES_INDEX = index hamm colorscan ioutil media videocontext cvutil qtutil database scanner templatematcher params videohashstore
 
 # deps for gui
 FILES_GUI = gui/mediagrouplistwidget gui/mediafolderlistwidget env \
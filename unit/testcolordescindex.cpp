@@ -1,9 +1,61 @@
 
 #include "testindexbase.h"
 #include "colordescindex.h"
+#include "colorscan.h"
+#include "cvutil.h"
 
 #include <QtTest/QtTest>
 
+/// Descriptor with random colors, and any number of them
+static ColorDescriptor randomDescriptor(QRandomGenerator& rand) {
+  ColorDescriptor d;
+  d.numColors = uint8_t(rand.bounded(ColorDescriptor::NUM_DESC_COLORS + 1));
+  for (int i = 0; i < d.numColors; ++i) {
+    d.colors[i].l = uint16_t(rand.bounded(DescriptorColor::max() + 1));
+    d.colors[i].u = uint16_t(rand.bounded(DescriptorColor::max() + 1));
+    d.colors[i].v = uint16_t(rand.bounded(DescriptorColor::max() + 1));
+  }
+  return d;
+}
+
+/**
+ * Compare find() to the distance to every item
+ * @details only the scores are compared, equal scores may be any of the items
+ */
+static void compareBruteForce(Index& index, const QMap<uint32_t, ColorDescriptor>& items,
+                              QRandomGenerator& rand, const SearchParams& params) {
+  for (uint32_t id = 1; id <= items.lastKey() + 1; ++id) {
+    Media m;
+    m.setId(int(id));
+    QCOMPARE(index.findIndexData(m), items.contains(id));
+    if (items.contains(id))
+      QVERIFY(memcmp(&m.colorDescriptor(), &items[id], sizeof(ColorDescriptor)) == 0);
+  }
+
+  for (int n = 0; n < 20; ++n) {
+    Media needle;
+    needle.setColorDescriptor(randomDescriptor(rand));
+
+    QVector<int> expected;
+    for (const ColorDescriptor& desc : items) {
+      const float distance = ColorDescriptor::distance(needle.colorDescriptor(), desc);
+      if (distance < FLT_MAX) expected.append(int(distance));
+    }
+    std::sort(expected.begin(), expected.end());
+    expected.resize(std::min(int(expected.count()), params.maxMatches));
+
+    QVector<int> actual;
+    for (const Index::Match& match : index.find(needle, params)) {
+      QVERIFY(items.contains(match.mediaId));
+      QCOMPARE(match.score,
+               int(ColorDescriptor::distance(needle.colorDescriptor(), items[match.mediaId])));
+      actual.append(match.score);
+    }
+    std::sort(actual.begin(), actual.end());
+    QCOMPARE(actual, expected);
+  }
+}
+
 class TestColorDescIndex : public TestIndexBase {
   Q_OBJECT
   SearchParams _params;
@@ -20,12 +72,171 @@ class TestColorDescIndex : public TestIndexBase {
   void testLoad() { baseTestLoad(_params); }
   void testAddRemove() { baseTestAddRemove(_params, 40); }
   void testMemoryUsage();
+  void testScan();
+  void testBuckets();
+  void testFindParallel();
 };
 
 void TestColorDescIndex::testMemoryUsage() {
-  // descriptor size plus media id size
-  QCOMPARE(_index->memoryUsage(),
-           (sizeof(ColorDescriptor) + 4) * size_t(_index->count()));
+  // descriptor size plus unpacked colors plus media id size, plus the id => slot map;
+  // slices build their map once, so it is the same as one built over the same ids
+  const size_t itemBytes = sizeof(ColorDescriptor) + sizeof(ColorPlanes) + 4;
+
+  std::vector<uint32_t> ids;
+  for (const Media& m : _database->mediaWithType(Media::TypeImage)) {
+    Media copy = m;
+    if (_index->findIndexData(copy)) ids.push_back(uint32_t(m.id()));
+  }
+  const uint32_t maxId = *std::max_element(ids.begin(), ids.end());
+  QVERIFY(maxId > 100);
+
+  std::unique_ptr<Index> all(_index->slice(QSet<uint32_t>(ids.begin(), ids.end())));
+  QCOMPARE(all->count(), int(ids.size()));
+  IdSlotMap slots;
+  slots.build(ids.data(), ids.size());
+  QCOMPARE(all->memoryUsage(), itemBytes * ids.size() + slots.memoryUsage());
+
+  // a slice of one item does not have a slot for every id
+  std::unique_ptr<Index> slice(_index->slice({maxId}));
+  QCOMPARE(slice->count(), 1);
+  slots.build(&maxId, 1);
+  QCOMPARE(slice->memoryUsage(), itemBytes + slots.memoryUsage());
+  QVERIFY(slice->memoryUsage() < itemBytes + 4 * size_t(maxId));
+
+  Media m;
+  m.setId(int(maxId));
+  QVERIFY(slice->findIndexData(m));
+}
+
+void TestColorDescIndex::testScan() {
+  // the simd kernels must give exactly the scalar distance
+  QRandomGenerator rand(1);
+  std::vector<ColorDescriptor> desc(1000);
+  for (auto& d : desc) d = randomDescriptor(rand);
+
+  std::vector<ColorPlanes> planes(desc.size());
+  for (size_t i = 0; i < desc.size(); ++i) colorUnpack(desc[i], planes[i]);
+
+  // every kernel this cpu supports, not only the one colorScan() uses
+  qInfo() << "kernel:" << colorScanKernel();
+  QVERIFY(!colorScanKernels().isEmpty());
+  QCOMPARE(colorScanKernels().last().name, "scalar");
+
+  std::vector<float> distances(desc.size());
+  for (const ColorScanKernel& kernel : colorScanKernels())
+    for (size_t n = 0; n < 50; ++n) {
+      kernel.scan(planes[n], planes.data(), planes.size(), FLT_MAX, distances.data());
+      for (size_t i = 0; i < desc.size(); ++i)
+        QVERIFY2(distances[i] == ColorDescriptor::distance(desc[n], desc[i]), kernel.name);
+
+      // anything at or above the bound is rejected
+      const float bound = 800;
+      kernel.scan(planes[n], planes.data(), planes.size(), bound, distances.data());
+      for (size_t i = 0; i < desc.size(); ++i) {
+        const float distance = ColorDescriptor::distance(desc[n], desc[i]);
+        QVERIFY2(distances[i] == (distance < bound ? distance : FLT_MAX), kernel.name);
+      }
+    }
+}
+
+void TestColorDescIndex::testBuckets() {
+  // items of every number of colors are inserted in the middle of the
+  // buckets, removed, compacted and sliced; lookups and searches must
+  // still see exactly the items that are left
+  QRandomGenerator rand(22);
+  ColorDescIndex index;
+  QMap<uint32_t, ColorDescriptor> items;
+  uint32_t nextId = 1;
+  QSqlDatabase db;  // unused by compact()
+
+  SearchParams params = _params;
+  params.maxMatches = 10;
+
+  for (int round = 0; round < 30; ++round) {
+    MediaGroup added;
+    const int numAdded = int(rand.bounded(60));
+    for (int i = 0; i < numAdded; ++i) {
+      Media m;
+      m.setId(int(nextId));
+      m.setColorDescriptor(randomDescriptor(rand));
+      items.insert(nextId++, m.colorDescriptor());
+      added.append(m);
+    }
+    index.add(added);
+
+    // some are unknown or removed already
+    QVector<int> removed;
+    const int numRemoved = int(rand.bounded(numAdded / 2 + 2));
+    for (int i = 0; i < numRemoved; ++i) {
+      const uint32_t id = 1 + rand.bounded(nextId);
+      removed.append(int(id));
+      items.remove(id);
+    }
+    index.remove(removed);
+
+    if (round % 4 == 3) {
+      index.compact(db, QString());
+      QCOMPARE(index.wastedMemory(), size_t(0));
+      QCOMPARE(index.count(), int(items.count()));
+    }
+
+    if (items.isEmpty()) continue;
+    compareBruteForce(index, items, rand, params);
+
+    if (round % 5 == 4) {
+      QSet<uint32_t> ids;
+      QMap<uint32_t, ColorDescriptor> sliceItems;
+      for (uint32_t id = 1; id < nextId; ++id)
+        if (rand.bounded(2)) {
+          ids.insert(id);
+          if (items.contains(id)) sliceItems.insert(id, items[id]);
+        }
+      std::unique_ptr<Index> slice(index.slice(ids));
+      if (!sliceItems.isEmpty()) compareBruteForce(*slice, sliceItems, rand, params);
+    }
+  }
+}
+
+void TestColorDescIndex::testFindParallel() {
+  // enough items for several chunks in the range of every needle
+  QRandomGenerator rand(24);
+  ColorDescIndex index;
+  int id = 1;
+  for (int batch = 0; batch < 5; ++batch) {
+    MediaGroup media;
+    for (int i = 0; i < 10000; ++i, ++id) {
+      Media m;
+      m.setId(id);
+      m.setColorDescriptor(randomDescriptor(rand));
+      media.append(m);
+    }
+    index.add(media);
+  }
+
+  auto byScore = [](const Index::Match& a, const Index::Match& b) {
+    return a.score < b.score || (a.score == b.score && a.mediaId < b.mediaId);
+  };
+
+  SearchParams params = _params;
+  for (int maxMatches : {10, 100000}) {
+    params.maxMatches = maxMatches;
+    for (int n = 0; n < 20; ++n) {
+      Media needle;
+      needle.setColorDescriptor(randomDescriptor(rand));
+
+      auto expected = index.find(needle, params);
+      auto actual = index.findParallel(needle, params);
+      std::sort(expected.begin(), expected.end(), byScore);
+      std::sort(actual.begin(), actual.end(), byScore);
+      QCOMPARE(actual.count(), expected.count());
+
+      // the last score may be tied with items that were not kept
+      for (int i = 0; i < expected.count(); ++i) {
+        QCOMPARE(actual[i].score, expected[i].score);
+        if (expected.count() < maxMatches) QCOMPARE(actual[i].mediaId, expected[i].mediaId);
+      }
+    }
+  }
 }
 
 QTEST_MAIN(TestColorDescIndex)
@@ -1,6 +1,6 @@
 include("pre.pri")
 
-FILES += cvutil ioutil
+FILES += cvutil colorscan ioutil
 
 contains(DEFINES, ENABLE_DEPRECATED) {
     LIBS += $$LIBS_LIBPHASH
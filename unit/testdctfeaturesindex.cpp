@@ -1,9 +1,30 @@
 
 #include "testindexbase.h"
 #include "dctfeaturesindex.h"
+#include "tree/hammingtree.h"
 
 #include <QtTest/QtTest>
 
+typedef std::map<HammingTree::index_t, HammingTree::distance_t> TreeMatches;
+
+/// Hashes around a few centers, so a search near one crosses several leaves
+static std::vector<uint64_t> clusteredHashes(QRandomGenerator64& rand, size_t count,
+                                             const std::vector<uint64_t>& centers) {
+  std::vector<uint64_t> hashes(count);
+  for (uint64_t& hash : hashes) {
+    hash = centers[rand.bounded(uint(centers.size()))];
+    for (uint j = rand.bounded(20u); j > 0; --j) hash ^= uint64_t(1) << rand.bounded(64u);
+  }
+  return hashes;
+}
+
+/// Replace the tree with the hashes, the index of hashes[i] is i+1 since 0 is removed
+static void buildTree(HammingTree& tree, std::vector<uint64_t> hashes) {
+  std::vector<HammingTree::index_t> indices(hashes.size());
+  for (size_t i = 0; i < indices.size(); ++i) indices[i] = HammingTree::index_t(i + 1);
+  tree.build(hashes, indices);  // the copies are used for scratch
+}
+
 class TestDctFeaturesIndex : public TestIndexBase {
   Q_OBJECT
   SearchParams _params;
@@ -20,11 +41,176 @@ class TestDctFeaturesIndex : public TestIndexBase {
   void testLoad() { baseTestLoad(_params); }
   void testAddRemove() { baseTestAddRemove(_params, 40); }
   void testMemoryUsage();
+  void testTreeProbes();
+  void testTreeMap();
 };
 
 void TestDctFeaturesIndex::testMemoryUsage() {
   QVERIFY(_index->memoryUsage() > 0);
 }
 
+void TestDctFeaturesIndex::testTreeProbes() {
+  // more probes (-p.dhp) only add leaves to the search, so they find a superset
+  // of the exact path, and never anything an exhaustive scan would not
+  SearchParams params;
+  params.setValue("dhp", 4);
+  QCOMPARE(params.treeProbes, 4);
+
+  QRandomGenerator64 rand(10);
+  std::vector<uint64_t> centers(20);
+  for (uint64_t& center : centers) center = rand.generate();
+  const std::vector<uint64_t> hashes = clusteredHashes(rand, 100000, centers);
+
+  HammingTree tree;
+  buildTree(tree, hashes);
+  const int numNodes = tree.stats().numNodes;  // more than the number of leaves
+  QVERIFY(numNodes > 8);
+
+  int numMissed = 0;  // exact path searches that did not find everything
+  for (int threshold : {4, 10, 20})
+    for (uint64_t center : centers) {
+      const uint64_t needle = center ^ (uint64_t(1) << rand.bounded(64u));
+
+      TreeMatches exhaustive;
+      for (size_t i = 0; i < hashes.size(); ++i) {
+        const int distance = hamm64(needle, hashes[i]);
+        if (distance < threshold) exhaustive[HammingTree::index_t(i + 1)] = distance;
+      }
+
+      TreeMatches previous;
+      for (int probes : {1, 2, params.treeProbes, 16, numNodes}) {
+        std::vector<HammingTree::Match> matches;
+        tree.search(needle, threshold, matches, probes);
+
+        TreeMatches found;
+        for (const HammingTree::Match& match : matches) {
+          QCOMPARE(match.distance, hamm64(needle, match.value.hash));
+          QCOMPARE(match.value.hash, hashes[match.value.index - 1]);
+          QVERIFY(exhaustive.count(match.value.index) == 1);
+          found[match.value.index] = match.distance;
+        }
+        QCOMPARE(found.size(), matches.size());  // no leaf is searched twice
+        for (const auto& prev : previous) QVERIFY(found.count(prev.first) == 1);
+
+        if (probes == 1 && found.size() < exhaustive.size()) numMissed++;
+        previous = found;
+      }
+      QVERIFY(previous == exhaustive);  // every leaf was probed
+
+      // many needles at once give the same
+      std::vector<std::vector<HammingTree::Match>> batch;
+      tree.search({needle, center}, threshold, batch, params.treeProbes);
+      std::vector<HammingTree::Match> matches;
+      tree.search(needle, threshold, matches, params.treeProbes);
+      QCOMPARE(batch[0].size(), matches.size());
+    }
+  QVERIFY(numMissed > 0);  // else probes were not tested
+}
+
+/// @return true if both trees find the same things near each hash
+static bool treesMatch(const HammingTree& a, const HammingTree& b,
+                       const std::vector<uint64_t>& needles) {
+  auto cmp = [](const HammingTree::Match& x, const HammingTree::Match& y) {
+    return x.distance < y.distance ||
+           (x.distance == y.distance && x.value.index < y.value.index);
+  };
+  for (uint64_t needle : needles)
+    for (int probes : {1, 4}) {
+      std::vector<HammingTree::Match> ma, mb;
+      a.search(needle, 12, ma, probes);
+      b.search(needle, 12, mb, probes);
+      std::sort(ma.begin(), ma.end(), cmp);
+      std::sort(mb.begin(), mb.end(), cmp);
+      if (ma.size() != mb.size()) return false;
+      for (size_t i = 0; i < ma.size(); ++i)
+        if (ma[i].value.index != mb[i].value.index || ma[i].value.hash != mb[i].value.hash ||
+            ma[i].distance != mb[i].distance)
+          return false;
+    }
+  return true;
+}
+
+void TestDctFeaturesIndex::testTreeMap() {
+  // a written tree can be mapped or read back, and is the same tree
+  QRandomGenerator64 rand(11);
+  std::vector<uint64_t> centers(20);
+  for (uint64_t& center : centers) center = rand.generate();
+  const std::vector<uint64_t> hashes = clusteredHashes(rand, 100000, centers);
+
+  HammingTree tree;
+  buildTree(tree, hashes);
+
+  QTemporaryFile f;
+  QVERIFY(f.open());
+  tree.write(f);
+  QVERIFY(f.flush());
+  const size_t len = size_t(f.size());
+
+  QVERIFY(f.seek(0));
+  QByteArray data = f.readAll();
+  QCOMPARE(size_t(data.size()), len);
+
+  // private mapping like the index caches, remove() must not write the file
+  uchar* ptr = f.map(0, f.size(), QFileDevice::MapPrivateOption);
+  QVERIFY(ptr);
+  {
+    HammingTree mapped, copy;
+    QVERIFY(mapped.map(reinterpret_cast<char*>(ptr), len));
+    QVERIFY(copy.read(data.constData(), len));
+
+    for (const HammingTree* t : {&mapped, &copy}) {
+      const HammingTree::Stats expected = tree.stats(), actual = t->stats();
+      QCOMPARE(actual.memory, expected.memory);
+      QCOMPARE(actual.numNodes, expected.numNodes);
+      QCOMPARE(actual.maxHeight, expected.maxHeight);
+      QCOMPARE(actual.numValues, expected.numValues);
+      QCOMPARE(actual.numRemoved, expected.numRemoved);
+      QVERIFY(treesMatch(tree, *t, centers));
+    }
+
+    // fewer than 1/4 removed, so they stay in the mapped clusters as index 0
+    std::unordered_set<HammingTree::index_t> removed;
+    for (HammingTree::index_t i = 1; i <= 1000; ++i) removed.insert(i * 7);
+    mapped.remove(removed);
+    QCOMPARE(mapped.stats().numRemoved, int(removed.size()));
+    for (uint64_t center : centers) {
+      std::vector<HammingTree::Match> matches;
+      mapped.search(center, 12, matches, 4);
+      for (const HammingTree::Match& match : matches)
+        QVERIFY(match.value.index == 0 || removed.count(match.value.index) == 0);
+    }
+
+    QFile file(f.fileName());
+    QVERIFY(file.open(QFile::ReadOnly));
+    QVERIFY(file.readAll() == data);
+  }
+  QVERIFY(f.unmap(ptr));
+
+  // truncated, extended or corrupted data is rejected and leaves the tree empty
+  auto rejected = [&](const QByteArray& bad) {
+    HammingTree t;
+    if (t.read(bad.constData(), size_t(bad.size()))) return false;
+    if (t.map(const_cast<char*>(bad.constData()), size_t(bad.size()))) return false;
+    std::vector<HammingTree::Match> matches;
+    t.search(centers[0], 64, matches);
+    return t.stats().numValues == 0 && matches.empty();
+  };
+  for (int size : {0, 16, int(len / 2), int(len) - 1})
+    QVERIFY2(rejected(data.left(size)), qPrintable(QString::number(size)));
+  QVERIFY(rejected(data + QByteArray(1, 0)));
+
+  // offsets of the file header (48 bytes) and the root node that follows it
+  auto corrupt = [&](int offset, uint32_t value) {
+    QByteArray bad = data;
+    memcpy(bad.data() + offset, &value, sizeof(value));
+    return bad;
+  };
+  QVERIFY(rejected(corrupt(0, 0)));                       // magic
+  QVERIFY(rejected(corrupt(8, 2)));                       // version
+  QVERIFY(rejected(corrupt(12, uint32_t(len))));          // numNodes
+  QVERIFY(rejected(corrupt(16, uint32_t(len))));          // numValues
+  QVERIFY(rejected(corrupt(48 + 4, 0)));                  // root's left child is itself
+}
+
 QTEST_MAIN(TestDctFeaturesIndex)
 #include "testdctfeaturesindex.moc"
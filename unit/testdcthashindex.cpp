@@ -1,6 +1,8 @@
 
 #include "testindexbase.h"
+#include "database.h"
 #include "dcthashindex.h"
+#include "hamm.h"
 
 #include <QtTest/QtTest>
 
@@ -20,13 +22,278 @@ class TestDctHashIndex : public TestIndexBase {
   void testDefaults() { baseTestDefaults(new DctHashIndex); }
   void testEmpty() { baseTestEmpty(new DctHashIndex); }
   void testLoad() { baseTestLoad(_params); }
+  void testCache();
   void testAddRemove() { baseTestAddRemove(_params, 40); }
   void testMemoryUsage();
+  void testScanKernels();
+  void testEnginesMatch();
+  void testPairsMatch();
+  void testCompact();
+  void testFindParallel();
+  void testFindNearest();
 };
 
 void TestDctHashIndex::testMemoryUsage() {
-  // 8 bytes per hash, plus 4 bytes index
-  QCOMPARE(_index->memoryUsage(), (size_t)(8 + 4) * _index->count());
+  // 8 bytes per hash, plus 4 bytes index, plus the tree, plus mih if it was searched
+  auto* index = static_cast<DctHashIndex*>(_index);
+  QCOMPARE(index->memoryUsage(), size_t(8 + 4) * size_t(index->count()) +
+                                     index->treeMemoryUsage() + index->mihMemoryUsage());
+
+  // a fresh index has no mih until it is searched with it
+  DctHashIndex fresh;
+  fresh.add(_database->mediaWithType(Media::TypeImage));
+  QCOMPARE(fresh.mihMemoryUsage(), size_t(0));
+  QCOMPARE(fresh.memoryUsage(), size_t(8 + 4) * size_t(fresh.count()) + fresh.treeMemoryUsage());
+
+  SearchParams params = _params;
+  params.dctEngine = SearchParams::DctEngineMih;
+  (void)fresh.find(_database->mediaWithType(Media::TypeImage).first(), params);
+  QVERIFY(fresh.mihMemoryUsage() > 0);
+  QCOMPARE(fresh.memoryUsage(), size_t(8 + 4) * size_t(fresh.count()) +
+                                    fresh.treeMemoryUsage() + fresh.mihMemoryUsage());
+}
+
+void TestDctHashIndex::testScanKernels() {
+  qInfo() << "kernel:" << hamm64ScanKernel();
+  QVERIFY(!hamm64ScanKernels().empty());
+  QCOMPARE(hamm64ScanKernels().back().name, "scalar");
+
+  // random hashes, with some near the needle so small thresholds match
+  QRandomGenerator rand(2);
+  std::vector<uint64_t> hashes(1001);
+  for (uint64_t& hash : hashes) hash = rand.generate64();
+  for (size_t i = 1; i < hashes.size(); i += 3)
+    hashes[i] = hashes[0] ^ (rand.generate64() & rand.generate64() & rand.generate64());
+  hashes[5] = hashes[0];
+  hashes[6] = ~hashes[0];  // distance 64
+
+  // counts that leave a tail after every vector width
+  for (const Hamm64ScanKernel& kernel : hamm64ScanKernels())
+    for (size_t count : {0, 1, 3, 7, 9, 13, 1001})
+      for (int threshold : {0, 1, 5, 12, 33, 64, 65}) {
+        std::vector<HammMatch> expected, actual;
+        for (size_t i = 0; i < count; ++i) {
+          const int distance = hamm64(hashes[0], hashes[i]);
+          if (distance < threshold) expected.push_back({uint32_t(i), distance});
+        }
+        kernel.scan(hashes[0], hashes.data(), count, threshold, actual);
+        QVERIFY2(actual.size() == expected.size(), kernel.name);
+        for (size_t i = 0; i < expected.size(); ++i) {
+          QVERIFY2(actual[i].index == expected[i].index, kernel.name);
+          QVERIFY2(actual[i].distance == expected[i].distance, kernel.name);
+        }
+      }
+}
+
+void TestDctHashIndex::testCache() {
+  const QString cacheFile = _database->cachePath() + "/dcthash.cache";
+  {
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "testCache");
+    db.setDatabaseName(_database->dbPath());
+    QVERIFY(db.open());
+
+    _index->save(db, _database->cachePath());  // if it is stale
+    QVERIFY(QFile::exists(cacheFile));
+    const QDateTime modified = QFileInfo(cacheFile).lastModified();
+    QFile f(cacheFile);
+    QVERIFY(f.open(QFile::ReadOnly));
+    const QByteArray contents = f.readAll();
+    f.close();
+
+    // another index maps the cache, and finds the same things
+    DctHashIndex index;
+    index.load(db, _database->cachePath(), QString());
+    QCOMPARE(index.count(), _index->count());
+
+    const MediaGroup images = _database->mediaWithType(Media::TypeImage);
+    QVERIFY(images.count() > 0);
+
+    auto cmp = [](const Index::Match& a, const Index::Match& b) {
+      return a.mediaId < b.mediaId || (a.mediaId == b.mediaId && a.score < b.score);
+    };
+    for (int engine : {SearchParams::DctEngineTree, SearchParams::DctEngineScan,
+                       SearchParams::DctEngineMih}) {
+      SearchParams params = _params;
+      params.dctEngine = engine;
+      for (const Media& needle : images) {
+        auto expected = _index->find(needle, params);
+        auto actual = index.find(needle, params);
+        std::sort(expected.begin(), expected.end(), cmp);
+        std::sort(actual.begin(), actual.end(), cmp);
+        QCOMPARE(actual.count(), expected.count());
+        for (int i = 0; i < expected.count(); ++i) {
+          QCOMPARE(actual[i].mediaId, expected[i].mediaId);
+          QCOMPARE(actual[i].score, expected[i].score);
+        }
+      }
+    }
+
+    // removing from the mapping is copy-on-write, the file does not change
+    const Media& removed = images[0];
+    index.remove({removed.id()});
+    for (const Index::Match& match : index.find(removed, _params))
+      QVERIFY(match.mediaId != uint32_t(removed.id()));
+
+    QCOMPARE(QFileInfo(cacheFile).lastModified(), modified);
+    QVERIFY(f.open(QFile::ReadOnly));
+    QVERIFY(f.readAll() == contents);
+    f.close();
+
+    db.close();
+  }
+  QSqlDatabase::removeDatabase("testCache");
+}
+
+void TestDctHashIndex::testEnginesMatch() {
+  // brute-force scan, multi-index hash and tree must find the same things
+  SearchParams params = _params;
+  const MediaGroupList groups = _database->similar(params);
+  QVERIFY(groups.count() > 0);
+
+  auto cmp = [](const Index::Match& a, const Index::Match& b) {
+    return a.mediaId < b.mediaId || (a.mediaId == b.mediaId && a.score < b.score);
+  };
+
+  for (int thresh : {1, 5, 12, 25}) {
+    params.dctThresh = thresh;
+    for (const MediaGroup& group : groups) {
+      params.dctEngine = SearchParams::DctEngineTree;
+      auto tree = _index->find(group[0], params);
+      std::sort(tree.begin(), tree.end(), cmp);
+
+      for (int engine : {SearchParams::DctEngineScan, SearchParams::DctEngineMih}) {
+        params.dctEngine = engine;
+        auto other = _index->find(group[0], params);
+        std::sort(other.begin(), other.end(), cmp);
+        QCOMPARE(other.count(), tree.count());
+        for (int i = 0; i < tree.count(); ++i) {
+          QCOMPARE(other[i].mediaId, tree[i].mediaId);
+          QCOMPARE(other[i].score, tree[i].score);
+        }
+      }
+    }
+  }
+}
+
+void TestDctHashIndex::testPairsMatch() {
+  // the self-join must find the same pairs as find() on every item
+  SearchParams params = _params;
+  const MediaGroup images = _database->mediaWithType(Media::TypeImage);
+  QVERIFY(images.count() > 0);
+
+  for (bool filterSelf : {false, true})
+    for (int thresh : {1, 5, 12, 25}) {
+      params.filterSelf = filterSelf;
+      params.dctThresh = thresh;
+
+      QMap<QPair<uint32_t, uint32_t>, int> expected;
+      for (const Media& m : images)
+        for (const Index::Match& match : _index->find(m, params)) {
+          const uint32_t id = uint32_t(m.id());
+          if (filterSelf && match.mediaId == id) continue;
+          expected.insert({std::min(id, match.mediaId), std::max(id, match.mediaId)},
+                          match.score);
+        }
+
+      QVector<Index::Pair> pairs;
+      QVERIFY(_index->findPairs(params, pairs));
+
+      QMap<QPair<uint32_t, uint32_t>, int> actual;
+      for (const Index::Pair& pair : pairs) {
+        const QPair<uint32_t, uint32_t> key(std::min(pair.a, pair.b), std::max(pair.a, pair.b));
+        QVERIFY(!actual.contains(key));  // each pair once
+        actual.insert(key, pair.score);
+      }
+
+      QCOMPARE(actual, expected);
+    }
+}
+
+void TestDctHashIndex::testCompact() {
+  // items removed by testAddRemove are still taking space
+  const MediaGroupList before = _database->similar(_params);
+  QVERIFY(_index->wastedMemory() > 0);
+  QVERIFY(_index->hasCompact());  // else Database::compact() skips it
+
+  _database->compact();
+  QCOMPARE(_index->wastedMemory(), (size_t)0);
+
+  const MediaGroupList after = _database->similar(_params);
+  QCOMPARE(after.count(), before.count());
+  for (int i = 0; i < before.count(); ++i)
+    QVERIFY(Media::groupCompareByContents(before[i], after[i]));
+}
+
+void TestDctHashIndex::testFindParallel() {
+  // clusters around a few hashes, more than one chunk of the scan
+  QRandomGenerator64 rand(24);
+  std::vector<uint64_t> centers(50);
+  for (uint64_t& center : centers) center = rand.generate();
+
+  DctHashIndex index;
+  int id = 1;
+  for (int batch = 0; batch < 20; ++batch) {
+    MediaGroup media;
+    for (int i = 0; i < 10000; ++i, ++id) {
+      uint64_t hash = centers[rand.bounded(uint(centers.size()))];
+      for (uint j = rand.bounded(16u); j > 0; --j) hash ^= uint64_t(1) << rand.bounded(64u);
+      Media m("", Media::TypeImage, 0, 0, "", hash);
+      m.setId(id);
+      media.append(m);
+    }
+    index.add(media);
+  }
+
+  SearchParams params = _params;
+  params.dctEngine = SearchParams::DctEngineScan;
+  for (int thresh : {5, 12}) {
+    params.dctThresh = thresh;
+    for (uint64_t center : centers) {
+      const Media needle("", Media::TypeImage, 0, 0, "", center);
+      const auto expected = index.find(needle, params);
+      const auto actual = index.findParallel(needle, params);
+      QVERIFY(expected.count() > 0);
+
+      // both are in item order
+      QCOMPARE(actual.count(), expected.count());
+      for (int i = 0; i < expected.count(); ++i) {
+        QCOMPARE(actual[i].mediaId, expected[i].mediaId);
+        QCOMPARE(actual[i].score, expected[i].score);
+      }
+    }
+  }
+}
+
+void TestDctHashIndex::testFindNearest() {
+  // the override must give what the default does, find() with increasing threshold
+  const MediaGroup images = _database->mediaWithType(Media::TypeImage);
+  QVERIFY(images.count() > 0);
+
+  auto cmp = [](const Index::Match& a, const Index::Match& b) {
+    return a.mediaId < b.mediaId || (a.mediaId == b.mediaId && a.score < b.score);
+  };
+  for (int engine : {SearchParams::DctEngineAuto, SearchParams::DctEngineTree,
+                     SearchParams::DctEngineScan, SearchParams::DctEngineMih})
+    for (int dctThresh : {0, 3, 8})
+      for (int maxThresh : {0, 5, 10, 20})
+        for (int minMatches : {0, 1, 2, 5}) {
+          SearchParams params = _params;
+          params.dctEngine = engine;
+          params.dctThresh = dctThresh;
+          params.maxThresh = maxThresh;
+          params.minMatches = minMatches;
+          for (const Media& needle : images) {
+            auto expected = _index->Index::findNearest(needle, params);
+            auto actual = _index->findNearest(needle, params);
+            std::sort(expected.begin(), expected.end(), cmp);
+            std::sort(actual.begin(), actual.end(), cmp);
+            QCOMPARE(actual.count(), expected.count());
+            for (int i = 0; i < expected.count(); ++i) {
+              QCOMPARE(actual[i].mediaId, expected[i].mediaId);
+              QCOMPARE(actual[i].score, expected[i].score);
+            }
+          }
+        }
 }
 
 QTEST_MAIN(TestDctHashIndex)
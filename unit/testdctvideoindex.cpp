@@ -3,8 +3,75 @@
 #include "dctvideoindex.h"
 #include "database.h"
 #include "scanner.h"
+#include "videohashstore.h"
 
 #include <QtTest/QtTest>
+#include <random>
+
+/// Video with random hashes, nothing matches it but copies of its frames
+static VideoIndex randomVideo(int numFrames, std::mt19937_64& rng) {
+  VideoIndex video;
+  for (int i = 0; i < numFrames; ++i) {
+    video.frames.push_back(uint32_t(i));
+    video.hashes.push_back(rng());
+  }
+  return video;
+}
+
+/// Append frames [begin, end) of a video, renumbered to follow the last frame
+static void appendClip(VideoIndex& video, const VideoIndex& source, int begin, int end) {
+  for (int i = begin; i < end; ++i) {
+    video.frames.push_back(uint32_t(video.frames.size()));
+    video.hashes.push_back(source.hashes[size_t(i)]);
+  }
+}
+
+/**
+ * Database of made-up videos, where the matching frames are known
+ * @note videos are not on disk, only their hashes are stored
+ */
+struct SyntheticVideos {
+  QTemporaryDir dir;
+  Database* database;
+  DctVideoIndex* index;
+  MediaGroup media;  // in id order
+
+  explicit SyntheticVideos(const QVector<VideoIndex>& videos) {
+    database = new Database(dir.path());
+    index = new DctVideoIndex;
+    database->addIndex(index);
+    database->setup();
+    for (int i = 0; i < videos.count(); ++i) {
+      Media m(qq("%1/%2.mp4").arg(database->path()).arg(i, 4, 10, lc('0')), Media::TypeVideo,
+              640, 480);
+      m.setMd5(QString::number(i));
+      m.setVideoIndex(videos[i]);
+      media.append(m);
+    }
+    database->add(media);
+
+    SearchParams params;
+    params.algo = SearchParams::AlgoVideo;
+    database->loadIndex(params);
+  }
+  ~SyntheticVideos() {
+    delete database;
+    delete index;
+    Database::disconnectAll();
+  }
+};
+
+static void compareMatches(const QVector<Index::Match>& actual,
+                           const QVector<Index::Match>& expected) {
+  QCOMPARE(actual.count(), expected.count());
+  for (int i = 0; i < expected.count(); ++i) {
+    QCOMPARE(actual[i].mediaId, expected[i].mediaId);
+    QCOMPARE(actual[i].score, expected[i].score);
+    QCOMPARE(actual[i].range.srcIn, expected[i].range.srcIn);
+    QCOMPARE(actual[i].range.dstIn, expected[i].range.dstIn);
+    QCOMPARE(actual[i].range.len, expected[i].range.len);
+  }
+}
 
 class TestDctVideoIndex : public TestIndexBase {
   Q_OBJECT
@@ -30,6 +97,12 @@ class TestDctVideoIndex : public TestIndexBase {
   void testAddRemove() { baseTestAddRemove(_params, numVideos); }
   void testMemoryUsage();
   void testLoad();
+  void testCache();
+  void testHashStore();
+  void testParallelFind();
+  void testAlign();
+  void testVideoTrees();
+  void testBuildTree();
 };
 
 void TestDctVideoIndex::testMemoryUsage() {
@@ -76,5 +149,355 @@ void TestDctVideoIndex::testLoad() {
   }
 }
 
+void TestDctVideoIndex::testCache() {
+  // testLoad() built the tree and cached it, another index should use that
+  const QString pattern = QString("dctvideo-%1-*.cache").arg(_params.skipFrames);
+  const QStringList files = QDir(_database->cachePath()).entryList({pattern});
+  QCOMPARE(files.count(), 1);
+  const QString cacheFile = _database->cachePath() + "/" + files[0];
+  const QDateTime modified = QFileInfo(cacheFile).lastModified();
+
+  {
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "testCache");
+    db.setDatabaseName(_database->dbPath());
+    QVERIFY(db.open());
+
+    DctVideoIndex index;
+    index.load(db, _database->cachePath(), _database->videoPath());
+
+    for (const Media& needle : _database->mediaWithType(Media::TypeVideo)) {
+      const auto expected = _index->find(needle, _params);
+      const auto actual = index.find(needle, _params);
+      QCOMPARE(actual.count(), expected.count());
+      for (int i = 0; i < expected.count(); ++i) {
+        QCOMPARE(actual[i].mediaId, expected[i].mediaId);
+        QCOMPARE(actual[i].score, expected[i].score);
+        QCOMPARE(actual[i].range.srcIn, expected[i].range.srcIn);
+        QCOMPARE(actual[i].range.dstIn, expected[i].range.dstIn);
+        QCOMPARE(actual[i].range.len, expected[i].range.len);
+      }
+    }
+    QVERIFY(index.memoryUsage() > 0);
+    db.close();
+  }
+  QSqlDatabase::removeDatabase("testCache");
+
+  // not rebuilt
+  QCOMPARE(QFileInfo(cacheFile).lastModified(), modified);
+}
+
+void TestDctVideoIndex::testHashStore() {
+  QTemporaryDir dir;
+  QVERIFY(dir.isValid());
+
+  auto makeIndex = [](int count, uint64_t seed) {
+    VideoIndex index;
+    for (int i = 0; i < count; ++i) {
+      index.frames.push_back(uint32_t(i) * 3);
+      index.hashes.push_back(seed * 1000003 + uint64_t(i));
+    }
+    return index;
+  };
+  auto equal = [](const VideoIndex& a, const VideoIndex& b) {
+    return a.frames == b.frames && a.hashes == b.hashes;
+  };
+
+  // legacy file: uint16_t numFrames, uint16_t frames[numFrames], uint64_t hashes[numFrames]
+  const VideoIndex legacy = makeIndex(100, 7);
+  {
+    QFile f(dir.path() + "/7.vdx");
+    QVERIFY(f.open(QFile::WriteOnly));
+    const uint16_t numFrames = 100;
+    f.write(reinterpret_cast<const char*>(&numFrames), sizeof(numFrames));
+    for (uint32_t frame : legacy.frames) {
+      const uint16_t legacyFrame = uint16_t(frame);
+      f.write(reinterpret_cast<const char*>(&legacyFrame), sizeof(legacyFrame));
+    }
+    f.write(reinterpret_cast<const char*>(legacy.hashes.data()),
+            qint64(legacy.hashes.size() * sizeof(uint64_t)));
+  }
+  // truncated legacy file, compact() must keep it
+  {
+    QFile f(dir.path() + "/8.vdx");
+    QVERIFY(f.open(QFile::WriteOnly));
+    const uint16_t numFrames = 100;
+    f.write(reinterpret_cast<const char*>(&numFrames), sizeof(numFrames));
+  }
+
+  VideoIndex loaded;
+  VideoHashStore store(dir.path());
+  store.add(1, makeIndex(10, 1));
+  store.add(2, makeIndex(70000, 2));  // more than 16-bit frames
+  store.add(3, makeIndex(1, 3));
+
+  // visible to the writer before commit()
+  QVERIFY(store.load(2, loaded));
+  QVERIFY(equal(loaded, makeIndex(70000, 2)));
+  store.commit();
+
+  // and to another instance after
+  VideoHashStore other(dir.path());
+  QCOMPARE(other.count(), size_t(3));
+  QVERIFY(other.load(1, loaded) && equal(loaded, makeIndex(10, 1)));
+  QVERIFY(other.load(2, loaded) && equal(loaded, makeIndex(70000, 2)));
+  QVERIFY(other.load(3, loaded) && equal(loaded, makeIndex(1, 3)));
+  QVERIFY(other.load(7, loaded) && equal(loaded, legacy));
+  QVERIFY(!other.load(8, loaded));
+
+  // replace and remove
+  store.add(1, makeIndex(20, 11));
+  store.remove(3);
+  store.commit();
+  QVERIFY(store.wastedBytes() > 0);
+
+  other.reload();
+  QVERIFY(other.load(1, loaded) && equal(loaded, makeIndex(20, 11)));
+  QVERIFY(!other.contains(3));
+
+  // drop the orphan, move the legacy file into the store, keep the unreadable one
+  store.compact([](uint32_t id) { return id != 2; });
+  QCOMPARE(store.wastedBytes(), uint64_t(0));
+  QCOMPARE(store.count(), size_t(2));
+  QVERIFY(!store.contains(2));
+  QVERIFY(store.load(1, loaded) && equal(loaded, makeIndex(20, 11)));
+  QVERIFY(store.load(7, loaded) && equal(loaded, legacy));
+  QVERIFY(!QFile::exists(dir.path() + "/7.vdx"));
+  QVERIFY(QFile::exists(dir.path() + "/8.vdx"));
+
+  const QStringList segments = QDir(dir.path()).entryList({"videohash-*.dat"});
+  QCOMPARE(segments.count(), 1);
+
+  // a segment without its directory is never replaced
+  const QString segment = dir.path() + "/" + segments[0];
+  const qint64 segmentSize = QFileInfo(segment).size();
+  QVERIFY(QFile::remove(dir.path() + "/videohash.dir"));
+
+  VideoHashStore broken(dir.path());
+  broken.add(9, makeIndex(10, 9));
+  broken.commit();
+  broken.compact([](uint32_t) { return true; });
+  QVERIFY(!broken.contains(9));
+  QCOMPARE(QDir(dir.path()).entryList({"videohash-*.dat"}), segments);
+  QCOMPARE(QFileInfo(segment).size(), segmentSize);
+
+  // a record that did not reach the disk (crash after the directory) is not read
+  QTemporaryDir tornDir;
+  QVERIFY(tornDir.isValid());
+  VideoHashStore torn(tornDir.path());
+  torn.add(1, makeIndex(10, 1));
+  torn.add(2, makeIndex(10, 2));
+  torn.commit();
+  torn.add(3, makeIndex(10, 3));
+  {
+    // frames at the end of records 2 and 3
+    QFile f(tornDir.path() + "/videohash-1.dat");
+    QVERIFY(f.open(QFile::ReadWrite));
+    const qint64 recordSize = 16 + 10 * 8 + 10 * 4;
+    for (qint64 end : {f.size() - recordSize, f.size()}) {
+      QVERIFY(f.seek(end - 8));
+      QCOMPARE(f.write(QByteArray(4, char(0xFF))), qint64(4));
+    }
+  }
+  QVERIFY(torn.load(1, loaded) && equal(loaded, makeIndex(10, 1)));
+  QVERIFY(!torn.load(2, loaded));  // mapped
+  QVERIFY(!torn.load(3, loaded));  // uncommitted
+}
+
+void TestDctVideoIndex::testParallelFind() {
+  // sources, and compilations of clips from them
+  std::mt19937_64 rng(16);
+  QVector<VideoIndex> videos;
+  for (int i = 0; i < 10; ++i) videos.append(randomVideo(2000, rng));
+  for (int i = 0; i < 20; ++i) {
+    VideoIndex video;
+    for (int j = 0; j < 3; ++j) {
+      const VideoIndex& source = videos[int(rng() % 10)];
+      const int begin = int(rng() % 1500);
+      appendClip(video, source, begin, begin + 100 + int(rng() % 400));
+    }
+    videos.append(video);
+  }
+  SyntheticVideos synthetic(videos);
+
+  SearchParams params = _params;
+  params.verbose = false;
+  params.maxSegments = 3;
+
+  // the needle is searched in chunks, one chunk per thread must give the same result
+  QThreadPool* pool = QThreadPool::globalInstance();
+  const int maxThreads = pool->maxThreadCount();
+  for (const Media& needle : synthetic.media) {
+    pool->setMaxThreadCount(1);
+    const auto expected = synthetic.index->find(needle, params);
+    pool->setMaxThreadCount(std::max(8, maxThreads));
+    const auto actual = synthetic.index->find(needle, params);
+    pool->setMaxThreadCount(maxThreads);
+
+    QVERIFY(expected.count() > 0);
+    compareMatches(actual, expected);
+  }
+}
+
+void TestDctVideoIndex::testAlign() {
+  std::mt19937_64 rng(17);
+  QVector<VideoIndex> videos;
+  for (int i = 0; i < 5; ++i) videos.append(randomVideo(3000, rng));
+  SyntheticVideos synthetic(videos);
+  const Media& source = synthetic.media[2];
+  const VideoIndex& sourceIndex = videos[2];
+
+  SearchParams params = _params;
+  auto findOne = [&](const VideoIndex& index) {
+    Media needle(synthetic.database->path() + "/needle.mp4", Media::TypeVideo, 640, 480);
+    needle.setVideoIndex(index);
+    const auto matches = synthetic.index->find(needle, params);
+    return matches.count() == 1 && matches[0].mediaId == uint32_t(source.id())
+               ? matches[0]
+               : Index::Match();
+  };
+
+  // one aligned copy
+  VideoIndex copy;
+  appendClip(copy, sourceIndex, 500, 2500);
+  Index::Match match = findOne(copy);
+  QCOMPARE(match.mediaId, uint32_t(source.id()));
+  QCOMPARE(match.score, 0);
+  QCOMPARE(match.range.srcIn, 0);
+  QCOMPARE(match.range.dstIn, 500);
+  QCOMPARE(match.range.len, 1999);
+
+  // compilation of two clips, one match with the range of the longest
+  VideoIndex compilation;
+  appendClip(compilation, sourceIndex, 2000, 2600);
+  appendClip(compilation, sourceIndex, 200, 1000);
+  for (int segments : {1, 2}) {
+    params.maxSegments = segments;
+    match = findOne(compilation);
+    QCOMPARE(match.mediaId, uint32_t(source.id()));
+    QCOMPARE(match.score, 0);
+    QCOMPARE(match.range.srcIn, 600);
+    QCOMPARE(match.range.dstIn, 200);
+    QCOMPARE(match.range.len, 799);
+  }
+  params.maxSegments = 1;
+
+  // frame rate change 24 => 25, the offset drifts by 100 frames
+  VideoIndex rateChanged;
+  for (int i = 0; i < 2400; ++i) {
+    rateChanged.frames.push_back(uint32_t(i));
+    rateChanged.hashes.push_back(sourceIndex.hashes[size_t(i * 25 / 24)]);
+  }
+  match = findOne(rateChanged);
+  QCOMPARE(match.mediaId, uint32_t(source.id()));
+  QCOMPARE(match.score, 0);
+  QCOMPARE(match.range.srcIn, 0);
+  QCOMPARE(match.range.dstIn, 0);
+  QCOMPARE(match.range.len, 2399 * 25 / 24);
+}
+
+void TestDctVideoIndex::testVideoTrees() {
+  std::mt19937_64 rng(18);
+  QVector<VideoIndex> videos;
+  for (int i = 0; i < 8; ++i) videos.append(randomVideo(2000, rng));
+  SyntheticVideos synthetic(videos);
+  DctVideoIndex* index = synthetic.index;
+
+  SearchParams params = _params;
+  params.verbose = false;
+
+  // search one video for one of its frames
+  auto findFrame = [&](int video, int frame) {
+    const Media& target = synthetic.media[video];
+    const Media needle(synthetic.database->path() + "/needle.jpg", Media::TypeImage, 640, 480,
+                       "needle", videos[video].hashes[size_t(frame)]);
+    params.target = uint32_t(target.id());
+    const auto matches = index->find(needle, params);
+    QCOMPARE(matches.count(), 1);
+    QCOMPARE(matches[0].mediaId, uint32_t(target.id()));
+    QCOMPARE(matches[0].score, 0);
+    QCOMPARE(matches[0].range.dstIn, frame);
+  };
+
+  // the main tree is not needed, so the usage is the cached tree
+  QCOMPARE(index->memoryUsage(), size_t(0));
+  findFrame(0, 100);
+  const size_t treeBytes = index->memoryUsage();
+  QVERIFY(treeBytes > 0);
+
+  // room for about two trees, the rest are evicted and rebuilt when searched again
+  const size_t budget = treeBytes * 5 / 2;
+  index->setVideoTreeBudget(qsizetype(budget));
+  for (int pass = 0; pass < 2; ++pass)
+    for (int video = 0; video < videos.count(); ++video) {
+      findFrame(video, int(rng() % 2000));
+      QVERIFY(index->memoryUsage() <= budget);
+      QVERIFY(index->memoryUsage() > 0);
+    }
+
+  // a tree larger than the budget is not cached, but is still searched
+  index->setVideoTreeBudget(qsizetype(treeBytes / 2));
+  QCOMPARE(index->memoryUsage(), size_t(0));
+  findFrame(3, 1999);
+  QCOMPARE(index->memoryUsage(), size_t(0));
+}
+
+void TestDctVideoIndex::testBuildTree() {
+  // pairs of a video and a clip of it
+  std::mt19937_64 rng(19);
+  QVector<VideoIndex> videos;
+  for (int i = 0; i < 80; ++i) {
+    const VideoIndex video = randomVideo(300, rng);
+    VideoIndex clip;
+    appendClip(clip, video, 50, 250);
+    videos.append(video);
+    videos.append(clip);
+  }
+
+  SearchParams params = _params;
+  params.verbose = false;
+
+  QThreadPool* pool = QThreadPool::globalInstance();
+  const int maxThreads = pool->maxThreadCount();
+  QVector<QVector<int>> groupIds[2];
+  QVector<QVector<Index::Match>> matches[2];
+  int count[2];
+
+  for (int parallel : {0, 1}) {
+    pool->setMaxThreadCount(parallel ? std::max(4, maxThreads) : 1);
+    SyntheticVideos synthetic(videos);
+
+    // every thread of similar() wants the tree at once, the one building
+    // it must not wait for pool threads that are waiting for it
+    const MediaGroupList groups = synthetic.database->similar(params);
+    for (const MediaGroup& group : groups) {
+      QVector<int> ids;
+      for (const Media& m : group) ids.append(m.id());
+      groupIds[parallel].append(ids);
+    }
+
+    // another index loads the same rows
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "testBuildTree");
+    db.setDatabaseName(synthetic.database->dbPath());
+    QVERIFY(db.open());
+    {
+      DctVideoIndex index;
+      index.load(db, QString(), synthetic.database->videoPath());
+      for (const Media& needle : synthetic.media)
+        matches[parallel].append(index.find(needle, params));
+      count[parallel] = index.count();
+    }
+    db.close();
+    db = QSqlDatabase();
+    QSqlDatabase::removeDatabase("testBuildTree");
+  }
+  pool->setMaxThreadCount(maxThreads);
+
+  QVERIFY(groupIds[1].count() >= videos.count() / 2);
+  QCOMPARE(groupIds[1], groupIds[0]);
+  QCOMPARE(count[1], count[0]);
+  QCOMPARE(count[1], 80 * (300 + 200));
+  for (int i = 0; i < videos.count(); ++i) compareMatches(matches[1][i], matches[0][i]);
+}
+
 QTEST_MAIN(TestDctVideoIndex)
 #include "testdctvideoindex.moc"
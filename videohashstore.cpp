@@ -0,0 +1,474 @@
+/* Packed storage of video frame hashes
+   Copyright (C) 2021 scrubbbbs
+   Contact: screubbbebs@gemeaile.com =~ s/e//g
+   Project: https://github.com/scrubbbbs/cbird
+
+   This file is part of cbird.
+
+   cbird is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   cbird is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with cbird; if not, see
+   <https://www.gnu.org/licenses/>.  */
+#include "videohashstore.h"
+
+#include "ioutil.h"
+#include "media.h"
+#include "qtutil.h"
+
+#include <array>
+
+/**
+ * Directory file: DirHeader, then Entry[numEntries] sorted by id
+ *
+ * Segment file: DataHeader, then records of
+ *   RecordHeader, uint64_t hashes[count], uint32_t frames[count], padding to 8 bytes
+ *
+ * Version 1 (no record checksum) was never released and is not read
+ */
+namespace {
+
+const char DIR_MAGIC[8] = {'c', 'b', 'v', 'h', 's', 'd', 'i', 'r'};
+const char DATA_MAGIC[8] = {'c', 'b', 'v', 'h', 's', 'd', 'a', 't'};
+const uint32_t VERSION = 2;
+
+struct DirHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t generation;  // segment in use
+  uint64_t numEntries;
+  uint64_t dataSize;  // bytes of the segment referenced by the directory
+};
+
+struct DataHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t generation;
+};
+
+struct RecordHeader {
+  uint32_t id;
+  uint32_t count;
+  uint32_t crc;  // of hashes and frames, the directory may be written before the data is on disk
+  uint32_t reserved;
+};
+
+uint64_t recordSize(uint64_t count) {
+  return sizeof(RecordHeader) + count * sizeof(uint64_t) + ((count * sizeof(uint32_t) + 7) & ~7ull);
+}
+
+/// CRC-32 (IEEE 802.3) of data, continuing from crc
+uint32_t crc32(const void* data, size_t len, uint32_t crc = 0) {
+  static const auto table = [] {
+    std::array<uint32_t, 256> t;
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      t[i] = c;
+    }
+    return t;
+  }();
+
+  const auto* p = static_cast<const uint8_t*>(data);
+  crc = ~crc;
+  while (len--) crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+uint32_t recordCrc(const uint64_t* hashes, const uint32_t* frames, uint32_t count) {
+  return crc32(frames, count * sizeof(uint32_t), crc32(hashes, count * sizeof(uint64_t)));
+}
+
+}  // namespace
+
+VideoHashStore::VideoHashStore(const QString& dirPath) : _dirPath(dirPath) { reload(); }
+
+VideoHashStore::~VideoHashStore() { unmap(); }
+
+QString VideoHashStore::dirFile() const { return _dirPath + qq("/videohash.dir"); }
+
+QString VideoHashStore::segmentFile(uint32_t generation) const {
+  return _dirPath + qq("/videohash-%1.dat").arg(generation);
+}
+
+QString VideoHashStore::legacyFile(uint32_t id) const {
+  return _dirPath + qq("/%1.vdx").arg(id);
+}
+
+void VideoHashStore::unmap() {
+  delete _mapFile;  // also unmaps
+  _mapFile = nullptr;
+  _map = nullptr;
+  _mapSize = 0;
+}
+
+void VideoHashStore::reload() {
+  unmap();
+  _entries.clear();
+  _generation = 0;
+  _dataSize = 0;
+  _unreadable = false;
+
+  const QString path = dirFile();
+  if (!QFile::exists(path)) {
+    // segments are not readable without the directory, but are not ours to replace
+    const QStringList segments = QDir(_dirPath).entryList({qq("videohash-*.dat")}, QDir::Files);
+    if (!segments.isEmpty()) {
+      qCritical() << "video hash store: directory is missing, move the segments away to start"
+                     " a new store:"
+                  << segments;
+      _unreadable = true;
+    }
+    return;
+  }
+
+  if (!readDirectory(path)) {
+    qCritical() << "video hash store: ignoring invalid or old version:" << path;
+    unmap();
+    _entries.clear();
+    _generation = 0;
+    _dataSize = 0;
+    _unreadable = true;
+  }
+}
+
+bool VideoHashStore::readDirectory(const QString& path) {
+  QFile dir(path);
+  if (!dir.open(QFile::ReadOnly)) {
+    qWarning() << "video hash store: open failed:" << dir.errorString();
+    return false;
+  }
+
+  DirHeader header;
+  if (dir.read(reinterpret_cast<char*>(&header), sizeof(header)) != sizeof(header)) return false;
+  if (memcmp(header.magic, DIR_MAGIC, sizeof(DIR_MAGIC)) || header.version != VERSION ||
+      header.generation == 0)
+    return false;
+
+  const uint64_t dirBytes = header.numEntries * sizeof(Entry);
+  if (uint64_t(dir.size()) != sizeof(header) + dirBytes) return false;
+
+  std::vector<Entry> entries(header.numEntries);
+  if (dir.read(reinterpret_cast<char*>(entries.data()), qint64(dirBytes)) != qint64(dirBytes))
+    return false;
+
+  // the directory may only reference data that was written before it
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const Entry& e = entries[i];
+    if (i > 0 && entries[i - 1].id >= e.id) return false;
+    if (e.offset < sizeof(DataHeader) || e.offset % 8) return false;
+    if (e.offset > header.dataSize || recordSize(e.count) > header.dataSize - e.offset)
+      return false;
+  }
+
+  QFile* file = new QFile(segmentFile(header.generation));
+  if (!file->open(QFile::ReadOnly) || uint64_t(file->size()) < header.dataSize ||
+      header.dataSize < sizeof(DataHeader)) {
+    delete file;
+    return false;
+  }
+
+  // shared read-only mapping, records past dataSize may be added later by
+  // another instance but are not visible until the directory is read again
+  const uchar* map = file->map(0, qint64(header.dataSize));
+  if (!map) {
+    delete file;
+    return false;
+  }
+
+  const auto* dataHeader = reinterpret_cast<const DataHeader*>(map);
+  if (memcmp(dataHeader->magic, DATA_MAGIC, sizeof(DATA_MAGIC)) ||
+      dataHeader->version != VERSION || dataHeader->generation != header.generation) {
+    delete file;
+    return false;
+  }
+
+  _mapFile = file;
+  _map = map;
+  _mapSize = header.dataSize;
+  _generation = header.generation;
+  _dataSize = header.dataSize;
+  _entries = std::move(entries);
+  return true;
+}
+
+const VideoHashStore::Entry* VideoHashStore::findEntry(uint32_t id) const {
+  auto it = std::lower_bound(_entries.begin(), _entries.end(), id,
+                             [](const Entry& e, uint32_t id) { return e.id < id; });
+  if (it == _entries.end() || it->id != id) return nullptr;
+  return &(*it);
+}
+
+bool VideoHashStore::contains(uint32_t id) const {
+  return findEntry(id) || QFile::exists(legacyFile(id));
+}
+
+bool VideoHashStore::view(uint32_t id, View& view) const {
+  view.hashStore.clear();
+  view.frameStore.clear();
+
+  const Entry* e = findEntry(id);
+
+  // uncommitted records are not mapped yet
+  if (e && e->offset + recordSize(e->count) <= _mapSize) {
+    const uchar* ptr = _map + e->offset;
+    const auto* header = reinterpret_cast<const RecordHeader*>(ptr);
+    if (header->id != e->id || header->count != e->count) {
+      qWarning("video hash store: corrupt record for id %u", id);
+      return false;
+    }
+    ptr += sizeof(RecordHeader);
+    const auto* hashes = reinterpret_cast<const uint64_t*>(ptr);
+    const auto* frames = reinterpret_cast<const uint32_t*>(ptr + e->count * sizeof(uint64_t));
+    if (recordCrc(hashes, frames, e->count) != header->crc) {
+      qWarning("video hash store: checksum failed for id %u", id);
+      return false;
+    }
+    view.hashes = hashes;
+    view.frames = frames;
+    view.count = e->count;
+    return true;
+  }
+
+  if (e) {
+    // read it from the file, it was added since the last commit()
+    QFile f(segmentFile(_generation));
+    RecordHeader header;
+    if (!f.open(QFile::ReadOnly) || !f.seek(qint64(e->offset)) ||
+        f.read(reinterpret_cast<char*>(&header), sizeof(header)) != sizeof(header) ||
+        header.id != e->id || header.count != e->count) {
+      qWarning("video hash store: failed to read uncommitted id %u", id);
+      return false;
+    }
+    view.hashStore.resize(e->count);
+    view.frameStore.resize(e->count);
+    const qint64 hashBytes = qint64(e->count * sizeof(uint64_t));
+    const qint64 frameBytes = qint64(e->count * sizeof(uint32_t));
+    if (f.read(reinterpret_cast<char*>(view.hashStore.data()), hashBytes) != hashBytes ||
+        f.read(reinterpret_cast<char*>(view.frameStore.data()), frameBytes) != frameBytes) {
+      qWarning("video hash store: failed to read uncommitted id %u", id);
+      return false;
+    }
+    if (recordCrc(view.hashStore.data(), view.frameStore.data(), e->count) != header.crc) {
+      qWarning("video hash store: checksum failed for uncommitted id %u", id);
+      return false;
+    }
+    view.hashes = view.hashStore.data();
+    view.frames = view.frameStore.data();
+    view.count = e->count;
+    return true;
+  }
+
+  return loadLegacy(id, view);
+}
+
+bool VideoHashStore::loadLegacy(uint32_t id, View& view) const {
+  const QString path = legacyFile(id);
+  if (!QFile::exists(path)) return false;
+
+  VideoIndex index;
+  if (!index.load(path)) {
+    qWarning("video hash store: failed to read legacy file for id %u", id);
+    return false;
+  }
+
+  const size_t count = std::min(index.frames.size(), index.hashes.size());
+  view.hashStore.assign(index.hashes.begin(), index.hashes.begin() + count);
+  view.frameStore.assign(index.frames.begin(), index.frames.begin() + count);
+  view.hashes = view.hashStore.data();
+  view.frames = view.frameStore.data();
+  view.count = uint32_t(count);
+  return true;
+}
+
+bool VideoHashStore::load(uint32_t id, VideoIndex& index) const {
+  View v;
+  if (!view(id, v)) return false;
+
+  index.hashes.assign(v.hashes, v.hashes + v.count);
+  index.frames.assign(v.frames, v.frames + v.count);
+  return true;
+}
+
+uint64_t VideoHashStore::appendRecord(QFile& f, uint32_t id, const uint64_t* hashes,
+                                      const uint32_t* frames, uint32_t count) {
+  const uint64_t offset = uint64_t(f.pos());
+  Q_ASSERT(offset % 8 == 0);
+
+  const RecordHeader header{id, count, recordCrc(hashes, frames, count), 0};
+  QByteArray data;
+  data.reserve(int(recordSize(count)));
+  data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  data.append(reinterpret_cast<const char*>(hashes), int(count * sizeof(uint64_t)));
+  data.append(reinterpret_cast<const char*>(frames), int(count * sizeof(uint32_t)));
+  data.append(int(recordSize(count) - uint64_t(data.size())), 0);
+
+  if (f.write(data) != data.size()) throw f.errorString();
+  return offset;
+}
+
+void VideoHashStore::add(uint32_t id, const VideoIndex& index) {
+  // a new segment would replace the one the directory could not read
+  if (_unreadable) {
+    qCritical("video hash store: not adding id %u, the store could not be read", id);
+    return;
+  }
+
+  const uint32_t count = uint32_t(std::min(index.frames.size(), index.hashes.size()));
+
+  const QString path = segmentFile(_generation ? _generation : 1);
+  try {
+    QFile f(path);
+    if (_generation == 0) {
+      if (!f.open(QFile::WriteOnly | QFile::Truncate)) throw f.errorString();
+      DataHeader header{{}, VERSION, 1};
+      memcpy(header.magic, DATA_MAGIC, sizeof(DATA_MAGIC));
+      if (f.write(reinterpret_cast<const char*>(&header), sizeof(header)) != sizeof(header))
+        throw f.errorString();
+      _generation = 1;
+      _dataSize = sizeof(header);
+    } else {
+      // overwrite anything past the directory, e.g. from a crash before commit()
+      if (!f.open(QFile::ReadWrite)) throw f.errorString();
+      if (!f.seek(qint64(_dataSize))) throw f.errorString();
+    }
+
+    const uint64_t offset = appendRecord(f, id, index.hashes.data(), index.frames.data(), count);
+    _dataSize = offset + recordSize(count);
+
+    const Entry entry{id, count, offset};
+    auto it = std::lower_bound(_entries.begin(), _entries.end(), id,
+                               [](const Entry& e, uint32_t id) { return e.id < id; });
+    if (it != _entries.end() && it->id == id)
+      *it = entry;
+    else
+      _entries.insert(it, entry);
+  } catch (const QString& error) {
+    qFatal("video hash store: write failed: %s: %s", qUtf8Printable(path), qUtf8Printable(error));
+  }
+}
+
+void VideoHashStore::remove(uint32_t id) {
+  auto it = std::lower_bound(_entries.begin(), _entries.end(), id,
+                             [](const Entry& e, uint32_t id) { return e.id < id; });
+  if (it != _entries.end() && it->id == id) _entries.erase(it);
+
+  const QString path = legacyFile(id);
+  if (QFile::exists(path) && !QFile::remove(path))
+    qCritical() << "video hash store: failed to remove" << path;
+}
+
+void VideoHashStore::writeDirectory(QFile& f, uint32_t generation, uint64_t dataSize,
+                                    const std::vector<Entry>& entries) {
+  DirHeader header{{}, VERSION, generation, entries.size(), dataSize};
+  memcpy(header.magic, DIR_MAGIC, sizeof(DIR_MAGIC));
+  if (f.write(reinterpret_cast<const char*>(&header), sizeof(header)) != sizeof(header))
+    throw f.errorString();
+
+  const qint64 bytes = qint64(entries.size() * sizeof(Entry));
+  if (f.write(reinterpret_cast<const char*>(entries.data()), bytes) != bytes) throw f.errorString();
+}
+
+void VideoHashStore::commit() {
+  if (_generation == 0) return;  // nothing was ever added
+
+  writeFileAtomically(dirFile(), [this](QFile& f) {
+    writeDirectory(f, _generation, _dataSize, _entries);
+  });
+
+  reload();
+}
+
+void VideoHashStore::compact(const std::function<bool(uint32_t)>& isValid) {
+  if (_unreadable) {
+    qCritical("video hash store: not compacting, the store could not be read");
+    return;
+  }
+
+  // legacy files are removed once imported, or if they are orphans
+  QVector<uint32_t> legacyIds;
+  const QStringList legacyNames = QDir(_dirPath).entryList({qq("*.vdx")}, QDir::Files);
+  for (const QString& name : legacyNames) {
+    bool ok;
+    const uint32_t id = name.split('.').first().toUInt(&ok);
+    if (ok) legacyIds.append(id);
+  }
+
+  std::vector<uint32_t> ids;
+  ids.reserve(_entries.size() + size_t(legacyIds.size()));
+  for (const Entry& e : _entries) ids.push_back(e.id);
+  for (uint32_t id : legacyIds) ids.push_back(id);
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+  const uint32_t oldGeneration = _generation;
+  const uint32_t generation = oldGeneration + 1;
+  std::vector<Entry> entries;
+  uint64_t dataSize = 0;
+  int numOrphans = 0;
+  QSet<uint32_t> unreadIds;  // not written to the new segment
+
+  writeFileAtomically(segmentFile(generation), [&](QFile& f) {
+    DataHeader header{{}, VERSION, generation};
+    memcpy(header.magic, DATA_MAGIC, sizeof(DATA_MAGIC));
+    if (f.write(reinterpret_cast<const char*>(&header), sizeof(header)) != sizeof(header))
+      throw f.errorString();
+
+    View v;
+    for (uint32_t id : ids) {
+      if (!isValid(id)) {
+        numOrphans++;
+        continue;
+      }
+      if (!view(id, v)) {
+        unreadIds.insert(id);
+        continue;
+      }
+      const uint64_t offset = appendRecord(f, id, v.hashes, v.frames, v.count);
+      entries.push_back({id, v.count, offset});
+    }
+    dataSize = uint64_t(f.pos());
+  });
+
+  // switching the directory commits the new segment
+  writeFileAtomically(dirFile(), [&](QFile& f) {
+    writeDirectory(f, generation, dataSize, entries);
+  });
+
+  const uint64_t oldSize = _dataSize;
+  unmap();
+
+  // other instances may still map the old segment, which is fine on unix
+  if (oldGeneration) {
+    const QString path = segmentFile(oldGeneration);
+    if (!QFile::remove(path)) qWarning() << "video hash store: failed to remove" << path;
+  }
+  for (uint32_t id : qAsConst(legacyIds)) {
+    const QString path = legacyFile(id);
+    if (unreadIds.contains(id))
+      qWarning() << "video hash store: keeping unreadable legacy file" << path;
+    else if (!QFile::remove(path))
+      qWarning() << "video hash store: failed to remove" << path;
+  }
+
+  reload();
+
+  qInfo("%d videos, %d orphans, %d legacy files, %d unreadable, %lld => %lld bytes",
+        int(entries.size()), numOrphans, int(legacyIds.size()), int(unreadIds.size()),
+        qint64(oldSize), qint64(_dataSize));
+}
+
+uint64_t VideoHashStore::wastedBytes() const {
+  if (_generation == 0) return 0;
+  uint64_t used = sizeof(DataHeader);
+  for (const Entry& e : _entries) used += recordSize(e.count);
+  return _dataSize > used ? _dataSize - used : 0;
+}
@@ -0,0 +1,137 @@
+/* Packed storage of video frame hashes
+   Copyright (C) 2021 scrubbbbs
+   Contact: screubbbebs@gemeaile.com =~ s/e//g
+   Project: https://github.com/scrubbbbs/cbird
+
+   This file is part of cbird.
+
+   cbird is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   cbird is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with cbird; if not, see
+   <https://www.gnu.org/licenses/>.  */
+#pragma once
+
+class VideoIndex;
+
+/**
+ * @class VideoHashStore
+ * @brief Packed storage for the VideoIndex of every video
+ *
+ * One data file (segment) holds the frame numbers and hashes of all videos,
+ * and a directory file maps media id to the offset of each record. The
+ * segment is memory-mapped, so reading all videos (DctVideoIndex::buildTree)
+ * does not need a file open and read per video.
+ *
+ * Records are appended, the directory is rewritten by commit(). Replaced or
+ * removed records stay in the segment until compact(), which writes a new
+ * segment and switches to it with the directory, so a crash at any point
+ * leaves a consistent store. Each record has a checksum, since the directory
+ * may reach the disk before the records it references; a torn record is
+ * not read. If a segment exists but the directory cannot be read, nothing
+ * is written so the segment is not replaced.
+ *
+ * Videos indexed before the store existed have one file per video
+ * (<id>.vdx) with 16-bit frame numbers, which are read if the id is not in
+ * the store, and moved into the store (32-bit frame numbers) by compact()
+ */
+class VideoHashStore {
+  Q_DISABLE_COPY_MOVE(VideoHashStore)
+
+ public:
+  /// Arrays of one video, valid until the next reload()/commit()/compact()
+  struct View {
+    const uint64_t* hashes = nullptr;
+    const uint32_t* frames = nullptr;
+    uint32_t count = 0;
+
+    // storage if the video was read from a legacy file
+    std::vector<uint64_t> hashStore;
+    std::vector<uint32_t> frameStore;
+  };
+
+  /// @param dirPath directory of the store and legacy files (Database::videoPath())
+  explicit VideoHashStore(const QString& dirPath);
+  ~VideoHashStore();
+
+  /// Read the directory again, after another instance changed the store
+  void reload();
+
+  /// @return true if the video is in the store or a legacy file
+  bool contains(uint32_t id) const;
+
+  /**
+   * Get the arrays of a video, without copying if possible
+   * @return false if the video is not in the store or a legacy file
+   */
+  bool view(uint32_t id, View& view) const;
+
+  /**
+   * Copy the index of a video
+   * @return false if the video is not in the store or a legacy file
+   */
+  bool load(uint32_t id, VideoIndex& index) const;
+
+  /// Add or replace a video, it may not be visible until commit()
+  void add(uint32_t id, const VideoIndex& index);
+
+  /// Remove a video, including its legacy file
+  void remove(uint32_t id);
+
+  /// Write the directory, making changes visible to reload()
+  void commit();
+
+  /**
+   * Write a new segment without removed records, also moving legacy files
+   * into the store
+   * @details Legacy files that cannot be read are kept
+   * @param isValid false for ids that should be removed (orphans)
+   */
+  void compact(const std::function<bool(uint32_t)>& isValid);
+
+  /// @return number of videos in the store (not counting legacy files)
+  size_t count() const { return _entries.size(); }
+
+  /// @return bytes in the segment not used by any record
+  uint64_t wastedBytes() const;
+
+ private:
+  struct Entry {
+    uint32_t id;
+    uint32_t count;   // number of frames/hashes
+    uint64_t offset;  // record offset in the segment
+  };
+
+  QString dirFile() const;
+  QString segmentFile(uint32_t generation) const;
+  QString legacyFile(uint32_t id) const;
+
+  void unmap();
+  bool readDirectory(const QString& path);
+  bool loadLegacy(uint32_t id, View& view) const;
+  const Entry* findEntry(uint32_t id) const;
+
+  /// append one record to the open segment, @return offset of the record
+  static uint64_t appendRecord(QFile& f, uint32_t id, const uint64_t* hashes,
+                               const uint32_t* frames, uint32_t count);
+
+  static void writeDirectory(QFile& f, uint32_t generation, uint64_t dataSize,
+                             const std::vector<Entry>& entries);
+
+  QString _dirPath;
+  uint32_t _generation = 0;     // segment file name suffix, 0 if there is none yet
+  std::vector<Entry> _entries;  // sorted by id
+  uint64_t _dataSize = 0;       // bytes of the segment in use, including uncommitted
+  QFile* _mapFile = nullptr;    // segment mapping
+  const uchar* _map = nullptr;
+  uint64_t _mapSize = 0;
+  bool _unreadable = false;  // a store exists but could not be read, do not write to it
+};